@@ -18,15 +18,25 @@
 #include <string.h>
 #include "buffer.h"
 #include "util.h"
-#include "endian.h"
+
+// Growable buffers start out with at least this much room.
+#define BUFFER_MIN_CAPACITY 256
+// Small writes to a chain buffer are gathered in segments of this size.
+#define BUFFER_CHAIN_SEGMENT 4096
+// Below this size buffer_write_ref() copies anyway, a segment costs more than the copy.
+#define BUFFER_CHAIN_MIN_REF 256
 
 buffer_t *buffer_create_memory(uint8_t *data, size_t size) {
 	buffer_t *buffer = malloc(sizeof(*buffer));
 	buffer->type = buftype_memory;
 	buffer->owned = false;
+	buffer->mem.grows = false;
 	buffer->mem.data = data;
 	buffer->mem.size = size;
+	buffer->mem.capacity = size;
+	buffer->mem.limit = 0;
 	buffer->mem.offset = 0;
+	buffer->mem.pool = NULL;
 
 	return buffer;
 }
@@ -36,11 +46,32 @@ buffer_t *buffer_allocate_memory(size_t size, bool grows) {
 	buffer->type = buftype_memory;
 	buffer->owned = true;
 	buffer->mem.grows = grows;
-	buffer->mem.data = size > 0 ? malloc(size) : NULL;
+	buffer->mem.data = size > 0 ? calloc(size, 1) : NULL;
 	buffer->mem.size = size;
+	buffer->mem.capacity = size;
+	buffer->mem.limit = 0;
 	buffer->mem.offset = 0;
+	buffer->mem.pool = NULL;
+
+	return buffer;
+}
+
+// An empty buffer that grows as it's written to, with room for capacity bytes up front. Pass the
+// expected size when it's known so the buffer never has to be copied.
+buffer_t *buffer_allocate_growable(size_t capacity) {
+	buffer_t *buffer = buffer_allocate_memory(0, true);
+	buffer_grow(buffer, capacity);
+	return buffer;
+}
 
-	memset(buffer->mem.data, 0, size);
+// A growable buffer that starts out in a block from pool and takes at most limit bytes. The block goes
+// back to the pool when the buffer is destroyed or outgrows it.
+buffer_t *buffer_allocate_pooled(pool_t *pool, size_t limit) {
+	buffer_t *buffer = buffer_allocate_memory(0, true);
+	buffer->mem.data = pool_alloc(pool);
+	buffer->mem.capacity = pool->object_size;
+	buffer->mem.limit = limit;
+	buffer->mem.pool = pool;
 
 	return buffer;
 }
@@ -68,6 +99,156 @@ buffer_t *buffer_open_file(const char *path, const char *mode) {
 	return buffer;
 }
 
+// A list of segments, for building output that mostly consists of payloads owned elsewhere. Small
+// headers are copied in, large payloads referenced with buffer_write_ref(), and the result is handed
+// to writev() or zlib a segment at a time with buffer_chain_iovec() or buffer_chain_next().
+buffer_t *buffer_create_chain(void) {
+	buffer_t *buffer = malloc(sizeof(*buffer));
+	buffer->type = buftype_chain;
+	buffer->owned = true;
+	buffer->chain.segs = NULL;
+	buffer->chain.num_segs = 0;
+	buffer->chain.segs_size = 0;
+	buffer->chain.first_offset = 0;
+	buffer->chain.size = 0;
+
+	return buffer;
+}
+
+static bufseg_t *buffer_chain_add(buffer_t *buffer) {
+	if (buffer->chain.num_segs == buffer->chain.segs_size) {
+		buffer->chain.segs_size = util_max(buffer->chain.segs_size * 2, 8);
+		buffer->chain.segs = realloc(buffer->chain.segs, buffer->chain.segs_size * sizeof(*buffer->chain.segs));
+	}
+
+	bufseg_t *seg = &buffer->chain.segs[buffer->chain.num_segs++];
+	seg->data = NULL;
+	seg->len = 0;
+	seg->capacity = 0;
+	return seg;
+}
+
+static void buffer_chain_clear(buffer_t *buffer) {
+	for (size_t i = 0; i < buffer->chain.num_segs; i++) {
+		if (buffer->chain.segs[i].capacity > 0) {
+			free(buffer->chain.segs[i].data);
+		}
+	}
+
+	buffer->chain.num_segs = 0;
+	buffer->chain.first_offset = 0;
+	buffer->chain.size = 0;
+}
+
+uint8_t *buffer_chain_reserve(buffer_t *buffer, size_t len) {
+	bufseg_t *seg = buffer->chain.num_segs > 0 ? &buffer->chain.segs[buffer->chain.num_segs - 1] : NULL;
+	if (seg == NULL || seg->len + len > seg->capacity) {
+		seg = buffer_chain_add(buffer);
+		seg->capacity = util_max(len, BUFFER_CHAIN_SEGMENT);
+		seg->data = malloc(seg->capacity);
+	}
+
+	uint8_t *data = seg->data + seg->len;
+	seg->len += len;
+	buffer->chain.size += len;
+	return data;
+}
+
+// Adds data without copying it to a chain buffer, the caller keeps it unchanged until the chain is
+// consumed or owned. Other buffers just copy it.
+void buffer_write_ref(buffer_t *buffer, const void *data, size_t len) {
+	if (buffer->type != buftype_chain || len < BUFFER_CHAIN_MIN_REF) {
+		buffer_write(buffer, data, len);
+		return;
+	}
+
+	bufseg_t *seg = buffer_chain_add(buffer);
+	seg->data = (uint8_t *)data;
+	seg->len = len;
+	buffer->chain.size += len;
+}
+
+// Fills in up to max iovecs with the unread part of a chain buffer, returns how many were used.
+size_t buffer_chain_iovec(buffer_t *buffer, struct iovec *iov, size_t max) {
+	size_t n = 0;
+	for (size_t i = 0; i < buffer->chain.num_segs && n < max; i++) {
+		const size_t skip = i == 0 ? buffer->chain.first_offset : 0;
+		if (buffer->chain.segs[i].len > skip) {
+			iov[n].iov_base = buffer->chain.segs[i].data + skip;
+			iov[n].iov_len = buffer->chain.segs[i].len - skip;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// Drops len bytes from the front of a chain buffer, once they have been sent.
+void buffer_chain_consume(buffer_t *buffer, size_t len) {
+	len = util_min(len, buffer->chain.size);
+	buffer->chain.size -= len;
+	if (buffer->chain.size == 0) {
+		buffer_chain_clear(buffer);
+		return;
+	}
+
+	size_t done = 0;
+	len += buffer->chain.first_offset;
+	while (done < buffer->chain.num_segs && buffer->chain.segs[done].len <= len) {
+		len -= buffer->chain.segs[done].len;
+		if (buffer->chain.segs[done].capacity > 0) {
+			free(buffer->chain.segs[done].data);
+		}
+		done++;
+	}
+
+	buffer->chain.num_segs -= done;
+	memmove(buffer->chain.segs, buffer->chain.segs + done, buffer->chain.num_segs * sizeof(*buffer->chain.segs));
+	buffer->chain.first_offset = len;
+}
+
+// Returns the next unread segment of a chain buffer and consumes it, NULL once it's empty. The data
+// stays valid until the next call.
+const uint8_t *buffer_chain_next(buffer_t *buffer, size_t *len) {
+	if (buffer->chain.first_offset > 0 || (buffer->chain.num_segs > 0 && buffer->chain.segs[0].len == 0)) {
+		buffer_chain_consume(buffer, 0);
+	}
+
+	struct iovec iov;
+	if (buffer_chain_iovec(buffer, &iov, 1) == 0) {
+		*len = 0;
+		return NULL;
+	}
+
+	// Mark it consumed without freeing it yet, it goes on the next call.
+	buffer->chain.first_offset += iov.iov_len;
+	buffer->chain.size -= iov.iov_len;
+	*len = iov.iov_len;
+	return iov.iov_base;
+}
+
+// Copies everything still referenced by a chain buffer, so the memory it points to can be reused.
+void buffer_chain_own(buffer_t *buffer) {
+	for (size_t i = 0; i < buffer->chain.num_segs; i++) {
+		bufseg_t *seg = &buffer->chain.segs[i];
+		if (seg->capacity == 0 && seg->len > 0) {
+			uint8_t *copy = malloc(seg->len);
+			memcpy(copy, seg->data, seg->len);
+			seg->data = copy;
+			seg->capacity = seg->len;
+		}
+	}
+}
+
+static void buffer_destroy_data(buffer_t *buffer) {
+	if (buffer->mem.pool != NULL) {
+		pool_free(buffer->mem.pool, buffer->mem.data);
+	}
+	else {
+		free(buffer->mem.data);
+	}
+}
+
 void buffer_destroy(buffer_t *buffer) {
 	if (buffer == NULL) {
 		return;
@@ -76,7 +257,7 @@ void buffer_destroy(buffer_t *buffer) {
 	if (buffer->owned) {
 		switch (buffer->type) {
 			case buftype_memory: {
-				free(buffer->mem.data);
+				buffer_destroy_data(buffer);
 				break;
 			}
 
@@ -85,6 +266,12 @@ void buffer_destroy(buffer_t *buffer) {
 				break;
 			}
 
+			case buftype_chain: {
+				buffer_chain_clear(buffer);
+				free(buffer->chain.segs);
+				break;
+			}
+
 			default: break;
 		}
 	}
@@ -92,40 +279,111 @@ void buffer_destroy(buffer_t *buffer) {
 	free(buffer);
 }
 
-size_t buffer_seek(buffer_t *buffer, size_t offset) {
-	switch (buffer->type) {
-		case buftype_memory: {
-			return buffer->mem.offset = util_min(offset, buffer->mem.size);
+// Sets both the size and the capacity, dropping anything past newsize. Returns false, leaving the buffer
+// as it was, if there isn't the memory for it.
+// Pooled blocks have a fixed size, so a pooled buffer moves to memory of its own the first time it changes.
+static bool buffer_realloc(buffer_t *buffer, size_t capacity) {
+	if (capacity == 0) {
+		buffer_destroy_data(buffer);
+		buffer->mem.data = NULL;
+	}
+	else if (buffer->mem.pool != NULL) {
+		uint8_t *data = malloc(capacity);
+		if (data == NULL) {
+			return false;
 		}
+		memcpy(data, buffer->mem.data, util_min(buffer->mem.capacity, capacity));
+		buffer_destroy_data(buffer);
+		buffer->mem.data = data;
+	}
+	else {
+		uint8_t *data = realloc(buffer->mem.data, capacity);
+		if (data == NULL) {
+			return false;
+		}
+		buffer->mem.data = data;
+	}
 
+	buffer->mem.capacity = capacity;
+	buffer->mem.pool = NULL;
+	return true;
+}
+
+void buffer_resize(buffer_t *buffer, size_t newsize) {
+	if (buffer->type != buftype_memory) {
+		return;
+	}
+
+	if (!buffer_realloc(buffer, newsize)) {
+		return;
+	}
+	buffer->mem.size = newsize;
+	buffer->mem.offset = util_min(buffer->mem.offset, newsize);
+}
+
+// Makes room for at least capacity bytes. Capacity at least doubles each time so writing a buffer
+// piece by piece stays linear. Returns false if the buffer can't hold that many, because of its limit
+// or because the memory isn't there.
+bool buffer_grow(buffer_t *buffer, size_t capacity) {
+	if (buffer->type != buftype_memory) {
+		return false;
+	}
+
+	if (capacity <= buffer->mem.capacity) {
+		return true;
+	}
+
+	size_t newcapacity = util_max(buffer->mem.capacity * 2, BUFFER_MIN_CAPACITY);
+	newcapacity = util_max(newcapacity, capacity);
+	if (buffer->mem.limit > 0) {
+		newcapacity = util_min(newcapacity, buffer->mem.limit);
+		if (newcapacity <= buffer->mem.capacity) {
+			return false;
+		}
+	}
+
+	// Doubling may ask for more than there is, what was asked for might still fit.
+	if (!buffer_realloc(buffer, newcapacity) && newcapacity > capacity) {
+		buffer_realloc(buffer, capacity);
+	}
+
+	return buffer->mem.capacity >= capacity;
+}
+
+size_t buffer_other_seek(buffer_t *buffer, size_t offset) {
+	switch (buffer->type) {
 		case buftype_file: {
 			return (size_t) fseek(buffer->file.fp, offset, SEEK_SET);
 		}
 
+		// Chains can only be emptied
+		case buftype_chain: {
+			if (offset == 0) {
+				buffer_chain_clear(buffer);
+			}
+			return buffer->chain.size;
+		}
+
 		default: return 0;
 	}
 }
 
-size_t buffer_tell(buffer_t *buffer) {
+size_t buffer_other_tell(buffer_t *buffer) {
 	switch (buffer->type) {
-		case buftype_memory: {
-			return buffer->mem.offset;
-		}
-
 		case buftype_file: {
 			return (size_t) ftell(buffer->file.fp);
 		}
 
+		case buftype_chain: {
+			return buffer->chain.size;
+		}
+
 		default: return 0;
 	}
 }
 
-size_t buffer_size(buffer_t *buffer) {
+size_t buffer_other_size(buffer_t *buffer) {
 	switch (buffer->type) {
-		case buftype_memory: {
-			return buffer->mem.size;
-		}
-
 		case buftype_file: {
 			long p = ftell(buffer->file.fp);
 			long size = fseek(buffer->file.fp, 0, SEEK_END);
@@ -133,61 +391,52 @@ size_t buffer_size(buffer_t *buffer) {
 			return size;
 		}
 
-		default: return 0;
-	}
-}
-
-void buffer_resize(buffer_t *buffer, size_t newsize) {
-	if (buffer->type != buftype_memory) {
-		return;
-	}
+		case buftype_chain: {
+			return buffer->chain.size;
+		}
 
-	if (newsize == 0 && buffer->mem.size != 0) {
-		free(buffer->mem.data);
-		buffer->mem.size = buffer->mem.offset = 0;
-	}
-	else {
-		buffer->mem.data = realloc(buffer->mem.data, newsize);
-		buffer->mem.size = newsize;
-		buffer->mem.offset = util_min(buffer->mem.offset, newsize);
+		default: return 0;
 	}
 }
 
-size_t buffer_read(buffer_t *buffer, void *data, const size_t len) {
+size_t buffer_other_read(buffer_t *buffer, void *data, size_t len) {
 	switch (buffer->type) {
-		case buftype_memory: {
-			size_t read = util_min(len, buffer->mem.size - buffer->mem.offset);
-			memcpy(data, buffer->mem.data + buffer->mem.offset, read);
-			buffer->mem.offset += read;
-			return read;
-		}
-
 		case buftype_file: {
 			return fread(data, 1, len, buffer->file.fp);
 		}
 
-		default: return 0;
-	}
-}
+		case buftype_chain: {
+			struct iovec iov[16];
+			const size_t n = buffer_chain_iovec(buffer, iov, 16);
 
-size_t buffer_write(buffer_t *buffer, const void *data, const size_t len) {
-	switch (buffer->type) {
-		case buftype_memory: {
-			if (buffer->type == buftype_memory && buffer->mem.grows && buffer->mem.offset + len > buffer->mem.size) {
-				buffer_resize(buffer, buffer->mem.offset + len);
+			size_t read = 0;
+			for (size_t i = 0; i < n && read < len; i++) {
+				const size_t part = util_min(iov[i].iov_len, len - read);
+				memcpy((uint8_t *)data + read, iov[i].iov_base, part);
+				read += part;
 			}
 
-			size_t written = util_min(len, buffer->mem.size - buffer->mem.offset);
-			memcpy(buffer->mem.data + buffer->mem.offset, data, written);
-			buffer->mem.offset += written;
-
-			return written;
+			buffer_chain_consume(buffer, read);
+			return read;
 		}
 
+		default: return 0;
+	}
+}
+
+size_t buffer_other_write(buffer_t *buffer, const void *data, size_t len) {
+	switch (buffer->type) {
 		case buftype_file: {
 			return fwrite(data, 1, len, buffer->file.fp);
 		}
 
+		case buftype_chain: {
+			if (len > 0) {
+				memcpy(buffer_chain_reserve(buffer, len), data, len);
+			}
+			return len;
+		}
+
 		default: return 0;
 	}
 }
@@ -201,95 +450,6 @@ size_t buffer_write_mc(buffer_t *buffer, const void *data, const size_t len) {
 	return 1024;
 }
 
-#define CHECK_SIZE()                                                \
-	if (buffer_tell(buffer) + sizeof(c) > buffer_size(buffer)) {    \
-		return false;                                               \
-	}
-
-bool buffer_read_uint8(buffer_t *buffer, uint8_t *data) {
-	uint8_t c; CHECK_SIZE();
-	buffer_read(buffer, &c, sizeof(c));
-	*data = c;
-	return true;
-}
-
-bool buffer_read_int8(buffer_t *buffer, int8_t *data) {
-	int8_t c; CHECK_SIZE();
-	buffer_read(buffer, &c, sizeof(c));
-	*data = c;
-	return true;
-}
-
-#define GENERIC_READ(function_name, data_type, swap_function)	    \
-	bool function_name (buffer_t *buffer, data_type *data) {        \
-		data_type c = (data_type)0; CHECK_SIZE();                   \
-		buffer_read(buffer, &c, sizeof(c));                         \
-		*data = swap_function(c);                                   \
-		return true;                                                \
-	}
-
-GENERIC_READ(buffer_read_uint16le, uint16_t, endian_tolittle16)
-GENERIC_READ(buffer_read_int16le,   int16_t, endian_tolittle16)
-GENERIC_READ(buffer_read_uint16be, uint16_t, endian_tobig16)
-GENERIC_READ(buffer_read_int16be,   int16_t, endian_tobig16)
-GENERIC_READ(buffer_read_uint32le, uint32_t, endian_tolittle32)
-GENERIC_READ(buffer_read_int32le,   int32_t, endian_tolittle32)
-GENERIC_READ(buffer_read_uint32be, uint32_t, endian_tobig32)
-GENERIC_READ(buffer_read_int32be,   int32_t, endian_tobig32)
-GENERIC_READ(buffer_read_uint64le, uint64_t, endian_tolittle64)
-GENERIC_READ(buffer_read_int64le,   int64_t, endian_tolittle64)
-GENERIC_READ(buffer_read_uint64be, uint64_t, endian_tobig64)
-GENERIC_READ(buffer_read_int64be,   int64_t, endian_tobig64)
-GENERIC_READ(buffer_read_floatle,     float, endian_tolittlef)
-GENERIC_READ(buffer_read_floatbe,     float, endian_tobigf)
-GENERIC_READ(buffer_read_doublele,   double, endian_tolittled)
-GENERIC_READ(buffer_read_doublebe,   double, endian_tobigd)
-
-#define CHECK_SIZE_MAYBE_GROW()                                     \
-	if (buffer_tell(buffer) + sizeof(c) > buffer_size(buffer)) {    \
-        if (buffer->type == buftype_memory && buffer->mem.grows) {  \
-            buffer_resize(buffer, buffer_size(buffer) + sizeof(c)); \
-		}                                                           \
-		else return false;                                          \
-	}
-
-#define GENERIC_WRITE(function_name, data_type, swap_function)      \
-	bool function_name (buffer_t *buffer, const data_type data) {   \
-		const data_type c = (data_type)swap_function(data);         \
-		CHECK_SIZE_MAYBE_GROW();                                    \
-		buffer_write(buffer, &c, sizeof(c));                        \
-		return true;                                                \
-	}
-
-bool buffer_write_uint8(buffer_t *buffer, const uint8_t data) {
-	const uint8_t c = data; CHECK_SIZE_MAYBE_GROW();
-	buffer_write(buffer, &c, sizeof(c));
-	return true;
-}
-
-bool buffer_write_int8(buffer_t *buffer, const int8_t data) {
-	const int8_t c = data; CHECK_SIZE_MAYBE_GROW();
-	buffer_write(buffer, &c, sizeof(c));
-	return true;
-}
-
-GENERIC_WRITE(buffer_write_uint16le, uint16_t, endian_tolittle16)
-GENERIC_WRITE(buffer_write_int16le,   int16_t, endian_tolittle16)
-GENERIC_WRITE(buffer_write_uint16be, uint16_t, endian_tobig16)
-GENERIC_WRITE(buffer_write_int16be,   int16_t, endian_tobig16)
-GENERIC_WRITE(buffer_write_uint32le, uint32_t, endian_tolittle32)
-GENERIC_WRITE(buffer_write_int32le,   int32_t, endian_tolittle32)
-GENERIC_WRITE(buffer_write_uint32be, uint32_t, endian_tobig32)
-GENERIC_WRITE(buffer_write_int32be,   int32_t, endian_tobig32)
-GENERIC_WRITE(buffer_write_uint64le, uint64_t, endian_tolittle64)
-GENERIC_WRITE(buffer_write_int64le,   int64_t, endian_tolittle64)
-GENERIC_WRITE(buffer_write_uint64be, uint64_t, endian_tobig64)
-GENERIC_WRITE(buffer_write_int64be,   int64_t, endian_tobig64)
-GENERIC_WRITE(buffer_write_floatle,     float, endian_tolittlef)
-GENERIC_WRITE(buffer_write_floatbe,     float, endian_tobigf)
-GENERIC_WRITE(buffer_write_doublele,   double, endian_tolittled)
-GENERIC_WRITE(buffer_write_doublebe,   double, endian_tobigd)
-
 void buffer_read_mcstr(buffer_t *buffer, char data[65]) {
 	buffer_read(buffer, data, 64);
 	int end = 63;
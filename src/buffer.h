@@ -19,12 +19,33 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include "endian.h"
+#include "pool.h"
+
+#ifdef _WIN32
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
 
 typedef enum {
 	buftype_memory,
-	buftype_file
+	buftype_file,
+	buftype_chain
 } buftype_t;
 
+// A piece of a chain buffer, either copied into the buffer or pointing at memory the writer keeps
+// alive until the chain is consumed or buffer_chain_own() is called.
+typedef struct bufseg_s {
+	uint8_t *data;
+	size_t len;
+	size_t capacity; // 0 if borrowed
+} bufseg_t;
+
 typedef struct buffer_s {
 	buftype_t type;
 	bool owned; // whether the buffer owns its underlying handle
@@ -33,68 +54,228 @@ typedef struct buffer_s {
 		struct {
 			bool grows;
 			uint8_t *data;
-			size_t size;
+			size_t size; // end of the data, reads stop here
+			size_t capacity; // allocated, growable buffers double it when they run out
+			size_t limit; // growable buffers stop growing here, 0 for no limit
 			size_t offset;
+			pool_t *pool; // where data goes back to, NULL if it's from malloc
 		} mem;
 
 		struct {
 			FILE *fp;
 		} file;
+
+		// Written at the end, read and consumed from the front. Not seekable.
+		struct {
+			bufseg_t *segs;
+			size_t num_segs;
+			size_t segs_size;
+			size_t first_offset; // already consumed from segs[0]
+			size_t size; // unread bytes
+		} chain;
 	};
 } buffer_t;
 
 buffer_t *buffer_create_memory(uint8_t *data, size_t size);
 buffer_t *buffer_allocate_memory(size_t size, bool grows);
+buffer_t *buffer_allocate_growable(size_t capacity);
+buffer_t *buffer_allocate_pooled(pool_t *pool, size_t limit);
 buffer_t *buffer_create_file(FILE *fp);
 buffer_t *buffer_open_file(const char *path, const char *mode);
+buffer_t *buffer_create_chain(void);
 void buffer_destroy(buffer_t *buffer);
 
-size_t buffer_seek(buffer_t *buffer, size_t size);
-size_t buffer_tell(buffer_t *buffer);
-size_t buffer_size(buffer_t *buffer);
 void buffer_resize(buffer_t *buffer, size_t newsize);
+bool buffer_grow(buffer_t *buffer, size_t capacity);
 
-size_t buffer_read(buffer_t *buffer, void *data, size_t len);
-size_t buffer_write(buffer_t *buffer, const void *data, size_t len);
 size_t buffer_write_mc(buffer_t *buffer, const void *data, size_t len);
-
-bool buffer_read_uint8(buffer_t *buffer, uint8_t *data);
-bool buffer_read_int8(buffer_t *buffer, int8_t *data);
-bool buffer_read_uint16le(buffer_t *buffer, uint16_t *data);
-bool buffer_read_int16le(buffer_t *buffer, int16_t *data);
-bool buffer_read_uint16be(buffer_t *buffer, uint16_t *data);
-bool buffer_read_int16be(buffer_t *buffer, int16_t *data);
-bool buffer_read_uint32le(buffer_t *buffer, uint32_t *data);
-bool buffer_read_int32le(buffer_t *buffer, int32_t *data);
-bool buffer_read_uint32be(buffer_t *buffer, uint32_t *data);
-bool buffer_read_int32be(buffer_t *buffer, int32_t *data);
-bool buffer_read_uint64le(buffer_t *buffer, uint64_t *data);
-bool buffer_read_int64le(buffer_t *buffer, int64_t *data);
-bool buffer_read_uint64be(buffer_t *buffer, uint64_t *data);
-bool buffer_read_int64be(buffer_t *buffer, int64_t *data);
-bool buffer_read_floatle(buffer_t *buffer, float *data);
-bool buffer_read_floatbe(buffer_t *buffer, float *data);
-bool buffer_read_doublele(buffer_t *buffer, double *data);
-bool buffer_read_doublebe(buffer_t *buffer, double *data);
-
-bool buffer_write_uint8(buffer_t *buffer, uint8_t data);
-bool buffer_write_int8(buffer_t *buffer, int8_t data);
-bool buffer_write_uint16le(buffer_t *buffer, uint16_t data);
-bool buffer_write_int16le(buffer_t *buffer, int16_t data);
-bool buffer_write_uint16be(buffer_t *buffer, uint16_t data);
-bool buffer_write_int16be(buffer_t *buffer, int16_t data);
-bool buffer_write_uint32le(buffer_t *buffer, uint32_t data);
-bool buffer_write_int32le(buffer_t *buffer, int32_t data);
-bool buffer_write_uint32be(buffer_t *buffer, uint32_t data);
-bool buffer_write_int32be(buffer_t *buffer, int32_t data);
-bool buffer_write_uint64le(buffer_t *buffer, uint64_t data);
-bool buffer_write_int64le(buffer_t *buffer, int64_t data);
-bool buffer_write_uint64be(buffer_t *buffer, uint64_t data);
-bool buffer_write_int64be(buffer_t *buffer, int64_t data);
-bool buffer_write_floatle(buffer_t *buffer, float data);
-bool buffer_write_floatbe(buffer_t *buffer, float data);
-bool buffer_write_doublele(buffer_t *buffer, double data);
-bool buffer_write_doublebe(buffer_t *buffer, double data);
+void buffer_write_ref(buffer_t *buffer, const void *data, size_t len);
 
 void buffer_read_mcstr(buffer_t *buffer, char data[65]);
 void buffer_write_mcstr(buffer_t *buffer, const char *data, bool filter);
+
+size_t buffer_chain_iovec(buffer_t *buffer, struct iovec *iov, size_t max);
+const uint8_t *buffer_chain_next(buffer_t *buffer, size_t *len);
+void buffer_chain_consume(buffer_t *buffer, size_t len);
+void buffer_chain_own(buffer_t *buffer);
+
+// File and chain buffers, see the inline functions below for memory buffers.
+size_t buffer_other_seek(buffer_t *buffer, size_t offset);
+size_t buffer_other_tell(buffer_t *buffer);
+size_t buffer_other_size(buffer_t *buffer);
+size_t buffer_other_read(buffer_t *buffer, void *data, size_t len);
+size_t buffer_other_write(buffer_t *buffer, const void *data, size_t len);
+uint8_t *buffer_chain_reserve(buffer_t *buffer, size_t len);
+
+static inline size_t buffer_seek(buffer_t *buffer, size_t offset) {
+	if (buffer->type != buftype_memory) {
+		return buffer_other_seek(buffer, offset);
+	}
+
+	return buffer->mem.offset = offset < buffer->mem.size ? offset : buffer->mem.size;
+}
+
+static inline size_t buffer_tell(buffer_t *buffer) {
+	return buffer->type == buftype_memory ? buffer->mem.offset : buffer_other_tell(buffer);
+}
+
+static inline size_t buffer_size(buffer_t *buffer) {
+	return buffer->type == buftype_memory ? buffer->mem.size : buffer_other_size(buffer);
+}
+
+// How many more bytes a memory buffer takes, counting what it's allowed to grow by.
+static inline size_t buffer_room(buffer_t *buffer) {
+	if (!buffer->mem.grows) {
+		return buffer->mem.capacity - buffer->mem.offset;
+	}
+
+	return buffer->mem.limit > 0 ? buffer->mem.limit - buffer->mem.offset : SIZE_MAX - buffer->mem.offset;
+}
+
+// Claims the next len bytes of a memory or chain buffer for the caller to fill in, growing it if allowed.
+// Returns NULL, leaving the buffer as it was, if they don't fit.
+static inline uint8_t *buffer_reserve(buffer_t *buffer, size_t len) {
+	if (buffer->type != buftype_memory) {
+		return buffer->type == buftype_chain ? buffer_chain_reserve(buffer, len) : NULL;
+	}
+
+	if (len > buffer->mem.capacity - buffer->mem.offset) {
+		if (len > buffer_room(buffer) || !buffer_grow(buffer, buffer->mem.offset + len)) {
+			return NULL;
+		}
+	}
+
+	uint8_t *data = buffer->mem.data + buffer->mem.offset;
+	buffer->mem.offset += len;
+	if (buffer->mem.offset > buffer->mem.size) {
+		buffer->mem.size = buffer->mem.offset;
+	}
+	return data;
+}
+
+// Returns the next len bytes of a memory buffer and skips past them, or NULL if there aren't that many.
+static inline const uint8_t *buffer_consume(buffer_t *buffer, size_t len) {
+	if (buffer->type != buftype_memory || len > buffer->mem.size - buffer->mem.offset) {
+		return NULL;
+	}
+
+	const uint8_t *data = buffer->mem.data + buffer->mem.offset;
+	buffer->mem.offset += len;
+	return data;
+}
+
+static inline size_t buffer_read(buffer_t *buffer, void *data, size_t len) {
+	if (buffer->type != buftype_memory) {
+		return buffer_other_read(buffer, data, len);
+	}
+
+	const size_t left = buffer->mem.size - buffer->mem.offset;
+	const size_t read = len < left ? len : left;
+	memcpy(data, buffer->mem.data + buffer->mem.offset, read);
+	buffer->mem.offset += read;
+	return read;
+}
+
+// Buffers that can't grow, or only so far, take as much as fits.
+static inline size_t buffer_write(buffer_t *buffer, const void *data, size_t len) {
+	if (buffer->type != buftype_memory) {
+		return buffer_other_write(buffer, data, len);
+	}
+
+	const size_t room = buffer_room(buffer);
+	if (len > room) {
+		len = room;
+	}
+
+	uint8_t *out = buffer_reserve(buffer, len);
+	if (out == NULL) {
+		return 0;
+	}
+	memcpy(out, data, len);
+	return len;
+}
+
+// All or nothing versions of the above, for the fixed size values below.
+static inline bool buffer_read_exact(buffer_t *buffer, void *data, size_t len) {
+	if (buffer->type != buftype_memory) {
+		return buffer_other_read(buffer, data, len) == len;
+	}
+
+	const uint8_t *in = buffer_consume(buffer, len);
+	if (in == NULL) {
+		return false;
+	}
+	memcpy(data, in, len);
+	return true;
+}
+
+static inline bool buffer_write_exact(buffer_t *buffer, const void *data, size_t len) {
+	if (buffer->type != buftype_memory) {
+		return buffer_other_write(buffer, data, len) == len;
+	}
+
+	uint8_t *out = buffer_reserve(buffer, len);
+	if (out == NULL) {
+		return false;
+	}
+	memcpy(out, data, len);
+	return true;
+}
+
+// Failed reads give 0.
+#define BUFFER_GENERIC_READ(function_name, data_type, swap_function)        \
+	static inline bool function_name(buffer_t *buffer, data_type *data) {   \
+		data_type c;                                                        \
+		if (!buffer_read_exact(buffer, &c, sizeof(c))) {                    \
+			*data = 0;                                                      \
+			return false;                                                   \
+		}                                                                   \
+		*data = swap_function(c);                                           \
+		return true;                                                        \
+	}
+
+#define BUFFER_GENERIC_WRITE(function_name, data_type, swap_function)           \
+	static inline bool function_name(buffer_t *buffer, const data_type data) {  \
+		const data_type c = (data_type)swap_function(data);                     \
+		return buffer_write_exact(buffer, &c, sizeof(c));                       \
+	}
+
+#define BUFFER_NO_SWAP(x) (x)
+
+BUFFER_GENERIC_READ(buffer_read_uint8,     uint8_t, BUFFER_NO_SWAP)
+BUFFER_GENERIC_READ(buffer_read_int8,       int8_t, BUFFER_NO_SWAP)
+BUFFER_GENERIC_READ(buffer_read_uint16le, uint16_t, endian_tolittle16)
+BUFFER_GENERIC_READ(buffer_read_int16le,   int16_t, endian_tolittle16)
+BUFFER_GENERIC_READ(buffer_read_uint16be, uint16_t, endian_tobig16)
+BUFFER_GENERIC_READ(buffer_read_int16be,   int16_t, endian_tobig16)
+BUFFER_GENERIC_READ(buffer_read_uint32le, uint32_t, endian_tolittle32)
+BUFFER_GENERIC_READ(buffer_read_int32le,   int32_t, endian_tolittle32)
+BUFFER_GENERIC_READ(buffer_read_uint32be, uint32_t, endian_tobig32)
+BUFFER_GENERIC_READ(buffer_read_int32be,   int32_t, endian_tobig32)
+BUFFER_GENERIC_READ(buffer_read_uint64le, uint64_t, endian_tolittle64)
+BUFFER_GENERIC_READ(buffer_read_int64le,   int64_t, endian_tolittle64)
+BUFFER_GENERIC_READ(buffer_read_uint64be, uint64_t, endian_tobig64)
+BUFFER_GENERIC_READ(buffer_read_int64be,   int64_t, endian_tobig64)
+BUFFER_GENERIC_READ(buffer_read_floatle,     float, endian_tolittlef)
+BUFFER_GENERIC_READ(buffer_read_floatbe,     float, endian_tobigf)
+BUFFER_GENERIC_READ(buffer_read_doublele,   double, endian_tolittled)
+BUFFER_GENERIC_READ(buffer_read_doublebe,   double, endian_tobigd)
+
+BUFFER_GENERIC_WRITE(buffer_write_uint8,     uint8_t, BUFFER_NO_SWAP)
+BUFFER_GENERIC_WRITE(buffer_write_int8,       int8_t, BUFFER_NO_SWAP)
+BUFFER_GENERIC_WRITE(buffer_write_uint16le, uint16_t, endian_tolittle16)
+BUFFER_GENERIC_WRITE(buffer_write_int16le,   int16_t, endian_tolittle16)
+BUFFER_GENERIC_WRITE(buffer_write_uint16be, uint16_t, endian_tobig16)
+BUFFER_GENERIC_WRITE(buffer_write_int16be,   int16_t, endian_tobig16)
+BUFFER_GENERIC_WRITE(buffer_write_uint32le, uint32_t, endian_tolittle32)
+BUFFER_GENERIC_WRITE(buffer_write_int32le,   int32_t, endian_tolittle32)
+BUFFER_GENERIC_WRITE(buffer_write_uint32be, uint32_t, endian_tobig32)
+BUFFER_GENERIC_WRITE(buffer_write_int32be,   int32_t, endian_tobig32)
+BUFFER_GENERIC_WRITE(buffer_write_uint64le, uint64_t, endian_tolittle64)
+BUFFER_GENERIC_WRITE(buffer_write_int64le,   int64_t, endian_tolittle64)
+BUFFER_GENERIC_WRITE(buffer_write_uint64be, uint64_t, endian_tobig64)
+BUFFER_GENERIC_WRITE(buffer_write_int64be,   int64_t, endian_tobig64)
+BUFFER_GENERIC_WRITE(buffer_write_floatle,     float, endian_tolittlef)
+BUFFER_GENERIC_WRITE(buffer_write_floatbe,     float, endian_tobigf)
+BUFFER_GENERIC_WRITE(buffer_write_doublele,   double, endian_tolittled)
+BUFFER_GENERIC_WRITE(buffer_write_doublebe,   double, endian_tobigd)
@@ -34,18 +34,25 @@
 #include "config.h"
 #include "namelist.h"
 #include "log.h"
+#include "playergrid.h"
 #include "version.h"
+#include "worker.h"
 
-#define BUFFER_SIZE (32 * 1024)
+#define BUFFER_SIZE (32 * 1024) // in_buffer and out_buffer never grow past this
 #define PING_INTERVAL (1.0)
 
 static void client_receive(client_t *client);
 static void client_login(client_t *client);
-static void client_send(client_t *client, buffer_t *buffer);
-static void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r);
+static bool client_send(client_t *client, buffer_t *buffer);
+static void client_handle_in_buffer(client_t *client, buffer_t *in_buffer);
+static void client_reject_block(client_t *client, size_t x, size_t y, size_t z);
+static void client_send_rejected(client_t *client);
+static void client_pick_spawn(float *x, float *y, float *z);
 static void client_send_level(client_t *client);
+static bool client_uses_fastmap(client_t *client);
 static void client_start_mapsave(client_t *client);
 static void client_start_fast_mapsave(client_t *client);
+static void client_replay_changes(client_t *client);
 static bool client_verify_key(char name[65], char key[65]);
 static void client_ws_upgrade(client_t *client, int r);
 static void client_ws_handle_packet(client_t *client, int len);
@@ -54,26 +61,33 @@ static void client_ws_decode_frame(client_t *client);
 static void client_ws_disconnect(client_t *client, int code);
 static void client_ws_wrap_packet(client_t *client, buffer_t *buffer);
 
-void client_init(client_t *client, int fd, size_t idx) {
+void client_init(client_t *client, int fd) {
 	memset(client, 0, sizeof(*client));
 
 	client->socket_fd = fd;
 	client->connected = true;
-	client->idx = idx;
-	client->in_buffer = buffer_allocate_memory(BUFFER_SIZE, false);
-	client->out_buffer = buffer_allocate_memory(BUFFER_SIZE, false);
+	client->entity_id = -1;
+	client->in_buffer = buffer_allocate_pooled(server.buffer_pool, BUFFER_SIZE);
+	client->out_buffer = buffer_allocate_pooled(server.buffer_pool, BUFFER_SIZE);
 	client->mapsend_state = mapsend_none;
 	client->mapgz_buffer = NULL;
+	client->has_snapshot = false;
+	client->snapshot_seq = 0;
+	client->join_ticket = 0;
+	client->queue_position = 0;
+	client->mapsend_memory = 0;
+	client->mapsend_streaming = false;
+	client->mapsend_ok = false;
+	client->mapsend_level = 0;
+	client->mapsend_max_level = 0;
+	client->level_cache = NULL;
+	client->level_image = NULL;
 	client->last_ping = 0;
 	client->ping = 0;
-	client->x = rng_next(server.global_rng, util_min(1023, (int)server.map->width)) + 0.5f;
-	client->z = rng_next(server.global_rng, util_min(1023, (int)server.map->height)) + 0.5f;
-	client->y = map_get_top(server.map, (size_t)client->x, (size_t)client->z) + 2.0f;
-	client->yaw = 0.0f;
-	client->pitch = 0.0f;
 	client->spawned = false;
-	client->num_extensions = 0;
-	client->extensions = NULL;
+	client->extensions = 0;
+	memset(client->extension_versions, 0, sizeof(client->extension_versions));
+	client->pending_extensions = 0;
 	client->customblocks_support = -1;
 	client->ws_can_switch = true;
 	client->using_websocket = false;
@@ -83,16 +97,47 @@ void client_init(client_t *client, int fd, size_t idx) {
 	client->ws_frame_read = 0;
 	client->ws_mask_read = 0;
 	client->ws_frame = NULL;
+	client->ws_input = NULL;
+	client->place_tokens.tokens = config.server.block_place_burst;
+	client->place_tokens.refilled = get_time_s();
+	client->break_tokens.tokens = config.server.block_break_burst;
+	client->break_tokens.refilled = client->place_tokens.refilled;
+	client->rejected = NULL;
+	client->num_rejected = 0;
+	client->rejected_size = 0;
+	client->input_budget = 0;
+	client->throttled_ticks = 0;
 	client->ws_out_buffer = NULL;
 
 	pthread_mutex_init(&client->out_mutex, NULL);
 }
 
 void client_destroy(client_t *client) {
-	free(client->extensions);
+	playergrid_remove(server.players, client);
+
+	if (client->entity_id >= 0) {
+		slottable_free(server.entities, (size_t)client->entity_id);
+	}
+
+	if (client->spectator) {
+		server.num_spectators--;
+	}
+
+	if (client->has_snapshot) {
+		map_snapshot_end(server.map, client->snapshot_seq);
+	}
+
+	if (client->level_cache != NULL) {
+		mapsend_cache_release(client->level_cache);
+	}
+
+	buffer_destroy(client->level_image);
 	closesocket(client->socket_fd);
+	buffer_destroy(client->mapgz_buffer);
 	buffer_destroy(client->ws_out_buffer);
 	buffer_destroy(client->ws_frame);
+	buffer_destroy(client->ws_input);
+	free(client->rejected);
 	buffer_destroy(client->in_buffer);
 	buffer_destroy(client->out_buffer);
 }
@@ -105,15 +150,13 @@ void client_tick(client_t *client) {
 	client_receive(client);
 
 	if (client->spawned && get_time_s() - client->last_ping >= PING_INTERVAL) {
-		if (client_supports_extension(client, "TwoWayPing", 1)) {
+		if (client_supports_extension(client, cpeext_two_way_ping)) {
 			client->ping_key = (uint16_t) rng_next(server.global_rng, UINT16_MAX);
-			buffer_write_uint8(client->out_buffer, packet_two_way_ping);
-			buffer_write_uint8(client->out_buffer, 1);
-			buffer_write_uint16be(client->out_buffer, client->ping_key);
+			packet_write_two_way_ping(client->out_buffer, 1, client->ping_key);
 			client_flush(client);
 		}
 		else {
-			buffer_write_uint8(client->out_buffer, packet_ping);
+			packet_write_ping(client->out_buffer);
 			client_flush(client);
 		}
 		client->last_ping = get_time_s();
@@ -130,53 +173,46 @@ void client_tick(client_t *client) {
 					client->mapsend_state = mapsend_sent;
 					client->mapgz_buffer = NULL;
 
-					buffer_write_uint8(client->out_buffer, packet_level_finish);
-					buffer_write_uint16be(client->out_buffer, server.map->width);
-					buffer_write_uint16be(client->out_buffer, server.map->depth);
-					buffer_write_uint16be(client->out_buffer, server.map->height);
-					client_flush(client);
-
-					buffer_write_uint8(client->out_buffer, packet_player_pos_angle);
-					buffer_write_int8(client->out_buffer, -1);
-					buffer_write_int16be(client->out_buffer, util_float2fixed(client->x));
-					buffer_write_int16be(client->out_buffer, util_float2fixed(client->y));
-					buffer_write_int16be(client->out_buffer, util_float2fixed(client->z));
-					buffer_write_int8(client->out_buffer, 0);
-					buffer_write_int8(client->out_buffer, 0);
-					client_flush(client);
+					// Keep the image for the next FastMap joiner, it has to be stored before the snapshot goes away.
+					if (client->level_image != NULL) {
+						mapsend_cache_store(client->snapshot_seq, client->level_image);
+						client->level_image = NULL;
+					}
 
-					for (size_t j = 0; j < server.num_clients; j++) {
-						client_t *other = &server.clients[j];
-						if (other == client) {
-							continue;
-						}
+					if (client->level_cache != NULL) {
+						mapsend_cache_release(client->level_cache);
+						client->level_cache = NULL;
+					}
 
-						// Inform the connecting client about others
-						buffer_write_uint8(client->out_buffer, packet_player_spawn);
-						buffer_write_uint8(client->out_buffer, other->idx);
-						buffer_write_mcstr(client->out_buffer, other->name, true);
-						buffer_write_int16be(client->out_buffer, util_float2fixed(other->x));
-						buffer_write_int16be(client->out_buffer, util_float2fixed(other->y));
-						buffer_write_int16be(client->out_buffer, util_float2fixed(other->y));
-						buffer_write_int8(client->out_buffer, util_degrees2fixed(other->yaw));
-						buffer_write_int8(client->out_buffer, util_degrees2fixed(other->pitch));
-						client_flush(client);
+					packet_write_level_finish(client->out_buffer, server.map->width, server.map->depth, server.map->height);
+					client_replay_changes(client);
+					client_flush(client);
 
-						// and inform others about this client
-						buffer_write_uint8(other->out_buffer, packet_player_spawn);
-						buffer_write_uint8(other->out_buffer, client->idx);
-						buffer_write_mcstr(other->out_buffer, client->name, true);
-						buffer_write_int16be(other->out_buffer, util_float2fixed(client->x));
-						buffer_write_int16be(other->out_buffer, util_float2fixed(client->y));
-						buffer_write_int16be(other->out_buffer, util_float2fixed(client->y));
-						buffer_write_int8(other->out_buffer, util_degrees2fixed(client->yaw));
-						buffer_write_int8(other->out_buffer, util_degrees2fixed(client->pitch));
-						client_flush(other);
+					float x, y, z;
+					if (client->spectator) {
+						client_pick_spawn(&x, &y, &z);
+					}
+					else {
+						x = server.poses.x[client->entity_id];
+						y = server.poses.y[client->entity_id];
+						z = server.poses.z[client->entity_id];
 					}
+					packet_write_player_pos_angle(client->out_buffer, 0xff, util_float2fixed(x), util_float2fixed(y), util_float2fixed(z), 0, 0);
+					client_flush(client);
 
+					// Other players are spawned for it, and it for them, at the end of the tick.
 					client->spawned = true;
 
-					server_broadcast("&e%s &fjoined the game.", client->name);
+					// There can be a lot of spectators, only players are announced.
+					if (client->spectator) {
+						log_printf(log_info, "%s joined as a spectator", client->name);
+						char text[65];
+						packet_write_message(client->out_buffer, 0x7f, packet_text(text, "&eThe server is full, you are spectating.", !client_supports_extension(client, cpeext_full_cp437)));
+						client_flush(client);
+					}
+					else {
+						server_broadcast("&e%s &fjoined the game.", client->name);
+					}
 
 					break;
 				}
@@ -186,18 +222,13 @@ void client_tick(client_t *client) {
 
 					size_t len = buffer_read(client->mapgz_buffer, data, 1024);
 
-					buffer_write_uint8(client->out_buffer, packet_level_chunk);
-					buffer_write_uint16be(client->out_buffer, (uint16_t)len);
-					buffer_write(client->out_buffer, data, 1024);
-					buffer_write_uint8(client->out_buffer, 0);
-
+					packet_write_level_chunk(client->out_buffer, (uint16_t)len, data, 0);
 					client_flush(client);
 				}
 			}
 		}
 		else if (client->mapsend_state == mapsend_failure) {
-			buffer_write_uint8(client->out_buffer, packet_player_disconnect);
-			buffer_write_mcstr(client->out_buffer, "Failed to send map data", false);
+			packet_write_player_disconnect(client->out_buffer, "Failed to send map data");
 			client_flush(client);
 		}
 	}
@@ -205,49 +236,236 @@ void client_tick(client_t *client) {
 	client_flush(client);
 }
 
+// Tells observer where client is now, in the smallest packet that does it: nothing if it hasn't moved,
+// only the angles if it just turned, a relative move within 4 blocks, or else the absolute position.
+// Doesn't flush, movement is sent for everyone at once at the end of the tick. If out_buffer is full the
+// next update is absolute, so the observer never ends up relative to a position it didn't get.
+void client_send_movement(client_t *observer, client_t *client) {
+	const uint8_t id = (uint8_t)client->entity_id;
+	entityview_t *view = &observer->views[id];
+
+	const int16_t x = util_float2fixed(server.poses.x[id]);
+	const int16_t y = util_float2fixed(server.poses.y[id]);
+	const int16_t z = util_float2fixed(server.poses.z[id]);
+	const int8_t yaw = util_degrees2fixed(server.poses.yaw[id]);
+	const int8_t pitch = util_degrees2fixed(server.poses.pitch[id]);
+
+	const int dx = x - view->x, dy = y - view->y, dz = z - view->z;
+	const bool moved = dx != 0 || dy != 0 || dz != 0;
+	const bool turned = yaw != view->yaw || pitch != view->pitch;
+	const bool relative = dx >= INT8_MIN && dx <= INT8_MAX && dy >= INT8_MIN && dy <= INT8_MAX && dz >= INT8_MIN && dz <= INT8_MAX;
+
+	if (view->known && !moved && !turned) {
+		return;
+	}
+
+	bool written;
+	if (!view->known || !relative) {
+		written = packet_write_player_pos_angle(observer->out_buffer, id, x, y, z, yaw, pitch);
+	}
+	else if (!moved) {
+		written = packet_write_player_angle_update(observer->out_buffer, id, yaw, pitch);
+	}
+	else if (!turned) {
+		written = packet_write_player_pos_update(observer->out_buffer, id, (int8_t)dx, (int8_t)dy, (int8_t)dz);
+	}
+	else {
+		written = packet_write_player_pos_angle_update(observer->out_buffer, id, (int8_t)dx, (int8_t)dy, (int8_t)dz, yaw, pitch);
+	}
+
+	if (!written) {
+		view->known = false;
+		return;
+	}
+
+	view->known = true;
+	view->x = x;
+	view->y = y;
+	view->z = z;
+	view->yaw = yaw;
+	view->pitch = pitch;
+}
+
+// If out_buffer is full the observer isn't told, and it's tried again next time.
+void client_send_spawn(client_t *observer, client_t *client) {
+	const uint8_t id = (uint8_t)client->entity_id;
+	entityview_t *view = &observer->views[id];
+
+	const int16_t x = util_float2fixed(server.poses.x[id]);
+	const int16_t y = util_float2fixed(server.poses.y[id]);
+	const int16_t z = util_float2fixed(server.poses.z[id]);
+	const int8_t yaw = util_degrees2fixed(server.poses.yaw[id]);
+	const int8_t pitch = util_degrees2fixed(server.poses.pitch[id]);
+
+	char name[65];
+	if (!packet_write_player_spawn(observer->out_buffer, id, packet_text(name, client->name, true), x, y, z, yaw, pitch)) {
+		return;
+	}
+
+	view->visible = true;
+	view->known = true;
+	view->generation = server.entities->generations[id];
+	view->x = x;
+	view->y = y;
+	view->z = z;
+	view->yaw = yaw;
+	view->pitch = pitch;
+}
+
+void client_send_despawn(client_t *observer, uint8_t id) {
+	observer->views[id].visible = false;
+	observer->views[id].known = false;
+
+	packet_write_player_despawn(observer->out_buffer, id);
+}
+
 void client_receive(client_t *client) {
-	buffer_seek(client->in_buffer, 0);
+	buffer_t *in = client->in_buffer;
+	size_t received = buffer_size(in); // held back last tick
+
+	client->input_budget = config.server.input_budget;
+
+	// Once a websocket client has this much waiting, leave the rest in the socket until it's caught up.
+	const bool backlogged = client->ws_input != NULL && buffer_size(client->ws_input) >= BUFFER_SIZE;
+
+	// in_buffer starts out small, it grows for as long as the socket has more to give. One byte is kept
+	// free so client_ws_upgrade() can terminate the request.
+	while (!backlogged) {
+		const size_t len = in->mem.capacity - received - 1;
+		if (len == 0) {
+			break;
+		}
+
 #ifdef _WIN32
-	int r = recv(client->socket_fd, (char *)client->in_buffer->mem.data, (int)client->in_buffer->mem.size, 0);
+		int r = recv(client->socket_fd, (char *)in->mem.data + received, (int)len, 0);
 #else
-	int r = recv(client->socket_fd, client->in_buffer->mem.data, client->in_buffer->mem.size, 0);
+		int r = recv(client->socket_fd, in->mem.data + received, len, 0);
 #endif
-	if (r == SOCKET_ERROR) {
-		int e = socket_error();
-		if (e == EAGAIN || e == SOCKET_EWOULDBLOCK) {
+		if (r == SOCKET_ERROR) {
+			int e = socket_error();
+			if (e == EAGAIN || e == SOCKET_EWOULDBLOCK) {
+				break;
+			}
+
+			if (e == EPIPE || e == SOCKET_ECONNABORTED || e == SOCKET_ECONNRESET) {
+				client->connected = false;
+				client_disconnect(client, "Disconnected");
+				return;
+			}
+
+			log_printf(log_error, "recv error %d", e);
+			client_disconnect(client, "Socket read error");
 			return;
 		}
 
-		if (e == EPIPE || e == SOCKET_ECONNABORTED || e == SOCKET_ECONNRESET) {
-			client->connected = false;
-			client_disconnect(client, "Disconnected");
-			return;
+		received += (size_t)r;
+		if ((size_t)r < len || in->mem.capacity >= BUFFER_SIZE) {
+			break;
 		}
 
-		log_printf(log_error, "recv error %d", e);
-		client_disconnect(client, "Socket read error");
-		return;
+		in->mem.size = received;
+		buffer_grow(in, in->mem.capacity + 1);
 	}
 
-	if (r == 0) {
-		return;
-	}
+	in->mem.size = received;
+	buffer_seek(in, 0);
 
-	if (client->ws_can_switch && memcmp(client->in_buffer->mem.data, "GET ", 4) == 0) {
-		client_ws_upgrade(client, r);
+	if (received >= 4 && client->ws_can_switch && memcmp(in->mem.data, "GET ", 4) == 0) {
+		client_ws_upgrade(client, (int)received);
+		in->mem.size = 0;
 		return;
 	}
 
+	// Frames are unwrapped as they come in, the packets in them wait in ws_input.
 	if (client->using_websocket) {
-		client_ws_handle_packet(client, r);
+		client_ws_handle_packet(client, (int)received);
+		in->mem.size = 0;
+		buffer_seek(in, 0);
+		in = client->ws_input;
 	}
-	else {
-		client_handle_in_buffer(client, client->in_buffer, (size_t)r);
+
+	client_handle_in_buffer(client, in);
+	client_send_rejected(client);
+}
+
+// Somewhere random on top of the level, within the first 1024 blocks along x and z.
+void client_pick_spawn(float *x, float *y, float *z) {
+	*x = rng_next(server.global_rng, util_min(1023, (int)server.map->width)) + 0.5f;
+	*z = rng_next(server.global_rng, util_min(1023, (int)server.map->height)) + 0.5f;
+	*y = map_get_top(server.map, (size_t)*x, (size_t)*z) + 2.0f;
+}
+
+// Takes a token for placing or breaking a block if there is one left. A rate of 0 means no limit.
+static bool client_take_token(client_t *client, bool is_break) {
+	tokenbucket_t *bucket = is_break ? &client->break_tokens : &client->place_tokens;
+	const unsigned rate = is_break ? config.server.block_break_rate : config.server.block_place_rate;
+	const unsigned burst = is_break ? config.server.block_break_burst : config.server.block_place_burst;
+	if (rate == 0) {
+		return true;
 	}
+
+	const double now = get_time_s();
+	bucket->tokens = fmin(bucket->tokens + (now - bucket->refilled) * rate, burst);
+	bucket->refilled = now;
+
+	if (bucket->tokens < 1.0) {
+		return false;
+	}
+
+	bucket->tokens -= 1.0;
+	return true;
 }
 
-void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
-	while (buffer_tell(in_buffer) < (size_t)r) {
+// How many bytes the packet starting with data takes, or 0 if clients don't send it. For an ident packet
+// that depends on the protocol version in its second byte.
+static size_t client_packet_size(const uint8_t *data, size_t len) {
+	switch (data[0]) {
+		case packet_ident: {
+			if (len < 2) {
+				return 2;
+			}
+
+			// See the "version 1" guess in client_handle_in_buffer()
+			const uint8_t version = data[1];
+			if (version >= 'A' && version <= 'z') {
+				return 1 + 64;
+			}
+
+			return 2 + 64 + (version >= 1 ? 64 : 0) + (version >= 6 ? 1 : 0);
+		}
+
+		case packet_set_block_client: return packet_set_block_client_size;
+		case packet_player_pos_angle: return packet_player_pos_angle_size;
+		case packet_message: return packet_message_size;
+		case packet_extinfo: return packet_extinfo_size;
+		case packet_extentry: return packet_extentry_size;
+		case packet_custom_block_support_level: return packet_custom_block_support_level_size;
+		case packet_two_way_ping: return packet_two_way_ping_size;
+		default: return 0;
+	}
+}
+
+// Handles the whole packets in in_buffer, as many as the client's input budget for this tick allows.
+// Whatever is left, over budget or not all there yet, is moved to the front and handled next tick.
+void client_handle_in_buffer(client_t *client, buffer_t *in_buffer) {
+	const size_t end = buffer_size(in_buffer);
+	buffer_seek(in_buffer, 0);
+
+	while (buffer_tell(in_buffer) < end) {
+		const size_t left = end - buffer_tell(in_buffer);
+		if (client_packet_size(in_buffer->mem.data + buffer_tell(in_buffer), left) > left) {
+			break;
+		}
+
+		if (client->input_budget == 0) {
+			if (client->throttled_ticks++ == 0) {
+				log_printf(log_info, "%s sends more than the input budget, holding back the rest", client->name);
+			}
+			server.throttled_clients++;
+			break;
+		}
+		client->input_budget--;
+
 		uint8_t packet_id;
 		buffer_read_uint8(in_buffer, &packet_id);
 
@@ -284,13 +502,15 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 
 				const bool supports_cpe = unused == 0x42;
 
-				if (server.num_clients > config.server.max_players) {
+				const bool logged_in = client->entity_id >= 0 || client->spectator;
+				const bool full = slottable_used(server.entities) >= config.server.max_players || server.entities->num_free == 0;
+				if (!logged_in && full && server.num_spectators >= config.server.max_spectators) {
 					client_disconnect(client, "This server is full.");
 					return;
 				}
 
 				for (size_t i = 0; i < server.num_clients; i++) {
-					if (strcasecmp(server.clients[i].name, username) == 0) {
+					if (server.clients[i]->connected && strcasecmp(server.clients[i]->name, username) == 0) {
 						client_disconnect(client, "Name already in use.");
 						return;
 					}
@@ -311,25 +531,30 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 					return;
 				}
 
+				if (!logged_in && full) {
+					client->spectator = true;
+					server.num_spectators++;
+				}
+				else if (!logged_in) {
+					size_t id;
+					slottable_alloc(server.entities, &id);
+					client->entity_id = (int)id;
+
+					client_pick_spawn(&server.poses.x[id], &server.poses.y[id], &server.poses.z[id]);
+					server.poses.yaw[id] = 0.0f;
+					server.poses.pitch[id] = 0.0f;
+				}
+
 				memcpy(client->name, username, 65);
 				client->is_op = namelist_contains(server.ops, client->name);
 
 				if (supports_cpe) {
 					char server_version[65];
 					snprintf(server_version, sizeof(server_version), "Thirty %s", HG_CHANGESET_HASH);
-					buffer_write_uint8(client->out_buffer, packet_extinfo);
-					buffer_write_mcstr(client->out_buffer, server_version, false);
-					buffer_write_uint16be(client->out_buffer, cpe_count_supported());
-
-					for (size_t i = 0; true; i++) {
-						cpeext_t *ext = &supported_extensions[i];
-						if (ext->name[0] == '\0') {
-							break;
-						}
+					packet_write_extinfo(client->out_buffer, server_version, cpeext_count);
 
-						buffer_write_uint8(client->out_buffer, packet_extentry);
-						buffer_write_mcstr(client->out_buffer, ext->name, false);
-						buffer_write_int32be(client->out_buffer, ext->version);
+					for (size_t i = 0; i < cpeext_count; i++) {
+						packet_write_extentry(client->out_buffer, supported_extensions[i].name, supported_extensions[i].version);
 					}
 
 					client_flush(client);
@@ -342,43 +567,45 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 			}
 
 			case packet_extinfo: {
-				char appname[65];
-				uint16_t extcount;
+				packet_extinfo_t packet;
+				if (!packet_read_extinfo(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
-				buffer_read_mcstr(in_buffer, appname);
-				buffer_read_uint16be(in_buffer, &extcount);
+				client->pending_extensions = (size_t)packet.count;
 
-				client->num_extensions = (size_t)extcount;
-				client->extensions = calloc(extcount, sizeof(*client->extensions));
+				log_printf(log_info, "Client using %s with %d extensions", packet.app_name, packet.count);
 
-				log_printf(log_info, "Client using %s with %d extensions", appname, extcount);
+				if (packet.count == 0) {
+					client_login(client);
+				}
 
 				break;
 			}
 
 			case packet_extentry: {
-				char name[65];
-				int32_t version;
-
-				buffer_read_mcstr(in_buffer, name);
-				buffer_read_int32be(in_buffer, &version);
+				packet_extentry_t packet;
+				if (!packet_read_extentry(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
-				size_t i;
-				for (i = 0; i < client->num_extensions; i++) {
-					if (i == client->num_extensions) {
-						log_printf(log_error, "extension overrun!");
-						client_disconnect(client, "Invalid data.");
-						return;
-					}
+				if (client->pending_extensions == 0) {
+					log_printf(log_error, "extension overrun!");
+					client_disconnect(client, "Invalid data.");
+					return;
+				}
 
-					if (client->extensions[i].name[0] == '\0') {
-						strncpy(client->extensions[i].name, name, 65);
-						client->extensions[i].version = version;
-						break;
+				const int ext = cpe_find(packet.name);
+				if (ext >= 0) {
+					client->extension_versions[ext] = packet.version;
+					if (packet.version == supported_extensions[ext].version) {
+						client->extensions |= (cpemask_t)1 << ext;
 					}
 				}
 
-				if (i == client->num_extensions - 1) {
+				if (--client->pending_extensions == 0) {
 					client_login(client);
 				}
 
@@ -386,37 +613,37 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 			}
 
 			case packet_set_block_client: {
-				uint16_t x, y, z;
-				uint8_t mode;
-				uint8_t block;
-
-				buffer_read_uint16be(in_buffer, &x);
-				buffer_read_uint16be(in_buffer, &y);
-				buffer_read_uint16be(in_buffer, &z);
-				buffer_read_uint8(in_buffer, &mode);
-				buffer_read_uint8(in_buffer, &block);
+				packet_set_block_client_t packet;
+				if (!packet_read_set_block_client(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
+				const uint16_t x = packet.x, y = packet.y, z = packet.z;
+				const uint8_t mode = packet.mode, block = packet.block;
 				const bool is_break = mode == 0x00;
 				const uint8_t current = map_get(server.map, x, y, z);
 
-				bool can_perform = true;
+				bool can_perform = !client->spectator;
 
-				if (!client->is_op) {
+				if (can_perform && !client->is_op) {
 					if (is_break) {
 						can_perform = !blockinfo[current].op_only_break;
 					}
 					else {
 						can_perform = !blockinfo[current].op_only_break && !blockinfo[block].op_only_place;
 					}
+
+					if (can_perform && !client_take_token(client, is_break)) {
+						can_perform = false;
+						if (client->num_over_limit++ == 0) {
+							log_printf(log_info, "%s changes blocks faster than allowed, undoing the extra changes", client->name);
+						}
+					}
 				}
 
 				if (!can_perform) {
-					buffer_write_uint8(client->out_buffer, packet_set_block_server);
-					buffer_write_uint16be(client->out_buffer, x);
-					buffer_write_uint16be(client->out_buffer, y);
-					buffer_write_uint16be(client->out_buffer, z);
-					buffer_write_uint8(client->out_buffer, current);
-					client_flush(client);
+					client_reject_block(client, x, y, z);
 				} else {
 					map_set(server.map, x, y, z, is_break ? 0x00 : block);
 				}
@@ -425,84 +652,71 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 			}
 
 			case packet_message: {
-				uint8_t unused;
-				char msg[65];
-
-				buffer_read_uint8(in_buffer, &unused);
-				buffer_read_mcstr(in_buffer, msg);
+				packet_message_t packet;
+				if (!packet_read_message(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
-				for (size_t i = 0; i < 64; i++) {
-					if (msg[i] == '%') {
-						msg[i] = '&';
+				for (size_t i = 0; packet.text[i] != '\0'; i++) {
+					if (packet.text[i] == '%') {
+						packet.text[i] = '&';
 					}
 				}
 
 				if (client->spawned) {
-					server_broadcast("&e%s: &f%s", client->name, msg);
+					server_broadcast("&e%s: &f%s", client->name, packet.text);
 				}
 
 				break;
 			}
 
 			case packet_player_pos_angle: {
-				int8_t unused;
-				int16_t x, y, z;
-				int8_t yaw, pitch;
-
-				buffer_read_int8(in_buffer, &unused);
-				buffer_read_int16be(in_buffer, &x);
-				buffer_read_int16be(in_buffer, &y);
-				buffer_read_int16be(in_buffer, &z);
-				buffer_read_int8(in_buffer, &yaw);
-				buffer_read_int8(in_buffer, &pitch);
-
-				client->x = util_fixed2float(x);
-				client->y = util_fixed2float(y);
-				client->z = util_fixed2float(z);
-				client->yaw = util_fixed2degrees(yaw);
-				client->pitch = util_fixed2degrees(pitch);
-
-				for (size_t i = 0; i < server.num_clients; i++) {
-					client_t *other = &server.clients[i];
-					if (other == client) {
-						continue;
-					}
+				packet_player_pos_angle_t packet;
+				if (!packet_read_player_pos_angle(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
-					buffer_write_uint8(other->out_buffer, packet_player_pos_angle);
-					buffer_write_int8(other->out_buffer, client->idx);
-					buffer_write_int16be(other->out_buffer, util_float2fixed(client->x));
-					buffer_write_int16be(other->out_buffer, util_float2fixed(client->y));
-					buffer_write_int16be(other->out_buffer, util_float2fixed(client->z));
-					buffer_write_int8(other->out_buffer, util_degrees2fixed(client->yaw));
-					buffer_write_int8(other->out_buffer, util_degrees2fixed(client->pitch));
-					client_flush(other);
+				// Nobody has been told where it is before it has an entity id.
+				if (client->entity_id < 0) {
+					break;
 				}
 
+				const int id = client->entity_id;
+				server.poses.x[id] = util_fixed2float(packet.x);
+				server.poses.y[id] = util_fixed2float(packet.y);
+				server.poses.z[id] = util_fixed2float(packet.z);
+				server.poses.yaw[id] = util_fixed2degrees(packet.yaw);
+				server.poses.pitch[id] = util_fixed2degrees(packet.pitch);
+
 				break;
 			}
 
 			case packet_custom_block_support_level: {
-				uint8_t level;
-				buffer_read_uint8(in_buffer, &level);
-				client->customblocks_support = level;
+				packet_custom_block_support_level_t packet;
+				if (!packet_read_custom_block_support_level(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
+
+				client->customblocks_support = packet.level;
 				client_send_level(client);
 				break;
 			}
 
 			case packet_two_way_ping: {
-				uint8_t direction;
-				uint16_t data;
-
-				buffer_read_uint8(in_buffer, &direction);
-				buffer_read_uint16be(in_buffer, &data);
+				packet_two_way_ping_t packet;
+				if (!packet_read_two_way_ping(in_buffer, &packet)) {
+					client_disconnect(client, "Received malformed data.");
+					return;
+				}
 
-				if (direction == 0) {
-					buffer_write_uint8(client->out_buffer, packet_two_way_ping);
-					buffer_write_uint8(client->out_buffer, direction);
-					buffer_write_uint16be(client->out_buffer, data);
+				if (packet.direction == 0) {
+					packet_write_two_way_ping(client->out_buffer, packet.direction, packet.data);
 					client_flush(client);
 				}
-				else if (data == client->ping_key) {
+				else if (packet.data == client->ping_key) {
 					client->ping = get_time_s() - client->last_ping;
 				}
 
@@ -510,12 +724,17 @@ void client_handle_in_buffer(client_t *client, buffer_t *in_buffer, size_t r) {
 			}
 
 			default: {
-				log_printf(log_error, "client %zu (%s) sent unknown packet 0x%02x", client->idx, client->name, packet_id);
+				log_printf(log_error, "client %d (%s) sent unknown packet 0x%02x", client->entity_id, client->name, packet_id);
 				client_disconnect(client, "Received malformed data.");
 				return;
 			};
 		}
 	}
+
+	const size_t handled = buffer_tell(in_buffer);
+	memmove(in_buffer->mem.data, in_buffer->mem.data + handled, end - handled);
+	in_buffer->mem.size = end - handled;
+	buffer_seek(in_buffer, end - handled);
 }
 
 bool client_verify_key(char name[65], char key[65]) {
@@ -533,39 +752,36 @@ bool client_verify_key(char name[65], char key[65]) {
 }
 
 void client_login(client_t *client) {
-	const bool cp437 = client_supports_extension(client, "FullCP437", 1);
-	const bool customblocks = client_supports_extension(client, "CustomBlocks", 1);
-	const bool textcolours = client_supports_extension(client, "TextColors", 1);
+	const bool cp437 = client_supports_extension(client, cpeext_full_cp437);
+	const bool customblocks = client_supports_extension(client, cpeext_custom_blocks);
+	const bool textcolours = client_supports_extension(client, cpeext_text_colors);
 
 	if (customblocks && client->customblocks_support == -1) {
-		buffer_write_uint8(client->out_buffer, packet_custom_block_support_level);
-		buffer_write_uint8(client->out_buffer, CPE_CUSTOMBLOCKS_LEVEL);
+		packet_write_custom_block_support_level(client->out_buffer, CPE_CUSTOMBLOCKS_LEVEL);
 		client_flush(client);
 	}
 
-	buffer_write_uint8(client->out_buffer, packet_ident);
-	if (client->protocol_version >= 3) {
+	char name[65], motd[65];
+	if (client->protocol_version >= 6) {
+		packet_write_ident(client->out_buffer, client->protocol_version, packet_text(name, config.server.name, cp437), packet_text(motd, config.server.motd, cp437), client->is_op ? 0x64 : 0x00);
+	}
+	else if (client->protocol_version >= 3) {
+		// Older layouts lack the user type
+		buffer_write_uint8(client->out_buffer, packet_ident);
 		buffer_write_uint8(client->out_buffer, client->protocol_version);
 		buffer_write_mcstr(client->out_buffer, config.server.name, cp437);
 		buffer_write_mcstr(client->out_buffer, config.server.motd, cp437);
-		if (client->protocol_version >= 6) {
-			buffer_write_uint8(client->out_buffer, client->is_op ? 0x64 : 0x00);
-		}
 	}
 	else {
 		// unused on early protocols
+		buffer_write_uint8(client->out_buffer, packet_ident);
 		buffer_write_mcstr(client->out_buffer, "", false);
 	}
 	client_flush(client);
 
 	if (textcolours) {
 		for (size_t i = 0; i < config.num_colours; i++) {
-			buffer_write_uint8(client->out_buffer, packet_set_text_colour);
-			buffer_write_uint8(client->out_buffer, config.colours[i].r);
-			buffer_write_uint8(client->out_buffer, config.colours[i].g);
-			buffer_write_uint8(client->out_buffer, config.colours[i].b);
-			buffer_write_uint8(client->out_buffer, config.colours[i].a);
-			buffer_write_uint8(client->out_buffer, (uint8_t)config.colours[i].code);
+			packet_write_set_text_colour(client->out_buffer, config.colours[i].r, config.colours[i].g, config.colours[i].b, config.colours[i].a, (uint8_t)config.colours[i].code);
 		}
 	}
 
@@ -574,152 +790,317 @@ void client_login(client_t *client) {
 	}
 }
 
+// Level transfers are started from the join queue in server_tick(), see client_start_level().
 void client_send_level(client_t *client) {
-	const bool fastmap = client_supports_extension(client, "FastMap", 1);
+	client->mapsend_state = mapsend_queued;
+	client->join_ticket = server.next_join_ticket++;
+	client->queue_position = 0;
+}
+
+bool client_uses_fastmap(client_t *client) {
+	return client_supports_extension(client, cpeext_fast_map) && client->customblocks_support >= CPE_CUSTOMBLOCKS_LEVEL;
+}
+
+size_t client_level_memory_estimate(client_t *client) {
+	return mapsend_memory_estimate(client_uses_fastmap(client));
+}
+
+void client_start_level(client_t *client) {
+	const bool fastmap = client_uses_fastmap(client);
 
-	if (fastmap && client->customblocks_support >= CPE_CUSTOMBLOCKS_LEVEL) {
-		buffer_write_uint8(client->out_buffer, packet_level_init);
-		buffer_write_uint32be(client->out_buffer, server.map->width * server.map->depth * server.map->height);
+	client->mapsend_state = mapsend_running;
+	client->mapsend_memory = mapsend_memory_estimate(fastmap);
+	mapsend_plan(client, fastmap);
+
+	if (fastmap) {
+		packet_write_level_init_fastmap(client->out_buffer, server.map->width * server.map->depth * server.map->height);
 		client_flush(client);
+		client->mapsend_streaming = true;
 		client_start_fast_mapsave(client);
 	}
 	else {
-		buffer_write_uint8(client->out_buffer, packet_level_init);
+		packet_write_level_init(client->out_buffer);
 		client_flush(client);
 		client_start_mapsave(client);
 	}
 }
 
-void client_send(client_t *client, buffer_t *buffer) {
-	if (buffer->mem.offset == 0) {
+void client_notify_queue_position(client_t *client, size_t position) {
+	if (client->queue_position == position) {
 		return;
 	}
 
-	int sendflags = 0;
+	client->queue_position = position;
+
+	char msg[65];
+	snprintf(msg, sizeof(msg), "&eYou are number %zu in the queue to load the level.", position);
+
+	char text[65];
+	packet_write_message(client->out_buffer, 0x7f, packet_text(text, msg, !client_supports_extension(client, cpeext_full_cp437)));
+	client_flush(client);
+}
+
+// Returns true once the whole buffer has been handed to the socket. Anything the socket didn't take
+// is kept at the start of the buffer and sent first on the next call.
+static bool client_send(client_t *client, buffer_t *buffer) {
+	if (buffer_tell(buffer) == 0) {
+		return true;
+	}
+
+	int r;
+	if (buffer->type == buftype_chain) {
+		struct iovec iov[16];
+		r = socket_sendv(client->socket_fd, iov, buffer_chain_iovec(buffer, iov, 16));
+	}
+	else {
+		int sendflags = 0;
 #ifndef _WIN32
-	sendflags |= MSG_NOSIGNAL;
+		sendflags |= MSG_NOSIGNAL;
 #endif
 
 #ifdef _WIN32
-	int r = send(client->socket_fd, (const char *)buffer->mem.data, (int)buffer->mem.offset, sendflags);
+		r = send(client->socket_fd, (const char *)buffer->mem.data, (int)buffer->mem.offset, sendflags);
 #else
-	int r = send(client->socket_fd, buffer->mem.data, buffer->mem.offset, sendflags);
+		r = send(client->socket_fd, buffer->mem.data, buffer->mem.offset, sendflags);
 #endif
-	buffer_seek(buffer, 0);
+	}
 
 	if (r == SOCKET_ERROR) {
 		int e = socket_error();
 		if (e == EAGAIN || e == SOCKET_EWOULDBLOCK) {
-			return;
+			return false;
 		}
 
+		buffer_seek(buffer, 0);
+
+		// out_mutex is held here, maybe by a level transfer thread, so the client is only marked. The
+		// main thread finishes the disconnect once the transfer is done.
 		if (e == EPIPE || e == SOCKET_ECONNABORTED || e == SOCKET_ECONNRESET) {
-			client->connected = false;
-			client_disconnect(client, "Disconnected");
-			return;
+			client->send_error = "Disconnected";
+		}
+		else {
+			log_printf(log_error, "send error %d", e);
+			client->send_error = "Socket write error";
 		}
 
-		log_printf(log_error, "send error %d", e);
-		client_disconnect(client, "Socket write error");
+		client->connected = false;
+		return true;
 	}
+
+	if (buffer->type == buftype_chain) {
+		buffer_chain_consume(buffer, (size_t)r);
+		return buffer_tell(buffer) == 0;
+	}
+
+	const size_t remaining = buffer->mem.offset - (size_t)r;
+	memmove(buffer->mem.data, buffer->mem.data + r, remaining);
+	buffer_seek(buffer, remaining);
+
+	return remaining == 0;
 }
 
-void client_flush_buffer(client_t *client, buffer_t *buffer) {
+bool client_flush_buffer(client_t *client, buffer_t *buffer) {
 	if (!client->connected) {
-		return;
+		return true;
 	}
 
 	pthread_mutex_lock(&client->out_mutex);
 
+	bool sent;
 	if (client->using_websocket) {
+		// The frame refers to buffer's data until it's sent, what's left is copied before buffer is reused.
 		client_ws_wrap_packet(client, buffer);
-		client_send(client, client->ws_out_buffer);
+		sent = client_send(client, client->ws_out_buffer);
+		buffer_chain_own(client->ws_out_buffer);
 		buffer_seek(buffer, 0);
 	}
 	else {
-		client_send(client, buffer);
+		sent = client_send(client, buffer);
 	}
 
 	pthread_mutex_unlock(&client->out_mutex);
+
+	return sent;
 }
 
 void client_flush(client_t *client) {
+	// The level transfer thread owns the socket until it's done, anything else waits in out_buffer.
+	if (client->mapsend_streaming) {
+		return;
+	}
+
 	client_flush_buffer(client, client->out_buffer);
 }
 
-void client_start_mapsave(client_t *client) {
-	mapsend_t *data = malloc(sizeof(*data));
-	data->client = client;
-	data->width = server.map->width;
-	data->height = server.map->height;
-	data->depth = server.map->depth;
+// Appends a run of whole packets of packet_size bytes each, flushing whenever out_buffer fills up. If
+// the socket stops taking data the rest is dropped rather than cutting a packet in half.
+void client_write_packets(client_t *client, const uint8_t *data, size_t len, size_t packet_size) {
+	while (len > 0) {
+		size_t space = buffer_room(client->out_buffer);
+		if (space < packet_size) {
+			client_flush(client);
+			space = buffer_room(client->out_buffer);
+			if (space < packet_size) {
+				return;
+			}
+		}
+
+		const size_t n = util_min(len, space - space % packet_size);
+		buffer_write(client->out_buffer, data, n);
+		data += n;
+		len -= n;
+	}
 
-	const uint32_t num_blocks = data->width * data->height * data->depth;
-	const size_t bufsize = sizeof(uint32_t) + num_blocks;
-	data->data = malloc(bufsize);
+	client_flush(client);
+}
 
-	buffer_t *buf = buffer_create_memory(data->data, bufsize);
-	buffer_write_uint32be(buf, num_blocks);
-	buffer_write(buf, server.map->blocks, num_blocks);
-	buffer_destroy(buf);
+// A BulkBlockUpdate packet is always full size, below this many changes separate packets are smaller.
+#define BULK_BLOCK_UPDATE_MIN (packet_bulk_block_update_size / packet_set_block_server_size + 1)
 
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
+void client_encode_block_changes(blockchanges_t *changes, map_t *map, const uint32_t *indices, size_t num) {
+	changes->single = buffer_allocate_memory(num * packet_set_block_server_size, false);
+	for (size_t i = 0; i < num; i++) {
+		size_t x, y, z;
+		map_index_to_pos(map, indices[i], &x, &y, &z);
+		packet_write_set_block_server(changes->single, x, y, z, map_get_index(map, indices[i]));
+	}
+
+	changes->num_bulk = num % 256 >= BULK_BLOCK_UPDATE_MIN ? num : num - num % 256;
+	changes->bulk = changes->num_bulk == 0 ? NULL : buffer_allocate_memory((changes->num_bulk + 255) / 256 * packet_bulk_block_update_size, false);
+
+	for (size_t first = 0; first < changes->num_bulk; first += 256) {
+		const size_t count = util_min(changes->num_bulk - first, 256);
+
+		uint32_t bulk_indices[256] = { 0 };
+		uint8_t bulk_blocks[256] = { 0 };
+		for (size_t i = 0; i < count; i++) {
+			bulk_indices[i] = indices[first + i];
+			bulk_blocks[i] = map_get_index(map, indices[first + i]);
+		}
+
+		packet_write_bulk_block_update(changes->bulk, (uint8_t)(count - 1), bulk_indices, bulk_blocks);
+	}
+}
 
-	pthread_t thread;
-	pthread_create(&thread, &attr, mapsend_thread_start, data);
+void client_free_block_changes(blockchanges_t *changes) {
+	buffer_destroy(changes->single);
+	buffer_destroy(changes->bulk);
+}
+
+void client_send_block_changes(client_t *client, const blockchanges_t *changes) {
+	const uint8_t *single = changes->single->mem.data;
+	size_t len = buffer_tell(changes->single);
+
+	if (changes->num_bulk > 0 && client_supports_extension(client, cpeext_bulk_block_update)) {
+		client_write_packets(client, changes->bulk->mem.data, buffer_tell(changes->bulk), packet_bulk_block_update_size);
+		single += changes->num_bulk * packet_set_block_server_size;
+		len -= changes->num_bulk * packet_set_block_server_size;
+	}
+
+	client_write_packets(client, single, len, packet_set_block_server_size);
+}
+
+// The client has already changed the block on its side, it gets told what's really there once it's
+// done sending.
+void client_reject_block(client_t *client, size_t x, size_t y, size_t z) {
+	if (!map_pos_valid(server.map, x, y, z)) {
+		return;
+	}
+
+	if (client->num_rejected == client->rejected_size) {
+		client->rejected_size = client->rejected_size == 0 ? 64 : client->rejected_size * 2;
+		client->rejected = realloc(client->rejected, sizeof(*client->rejected) * client->rejected_size);
+	}
+	client->rejected[client->num_rejected++] = (uint32_t)map_get_block_index(server.map, x, y, z);
+}
+
+void client_send_rejected(client_t *client) {
+	if (client->num_rejected == 0) {
+		return;
+	}
+
+	// A client hammering one position gets that block back once.
+	const size_t num = map_sort_unique_indices(client->rejected, client->num_rejected);
+
+	blockchanges_t changes;
+	client_encode_block_changes(&changes, server.map, client->rejected, num);
+	client_send_block_changes(client, &changes);
+	client_free_block_changes(&changes);
+
+	client->num_rejected = 0;
+}
+
+// Runs on the main thread once the transfer job has returned, so it no longer touches the client.
+static void client_mapsend_done(void *data) {
+	client_t *client = (client_t *)data;
+
+	client->mapsend_streaming = false;
+	client->mapsend_state = client->mapsend_ok ? mapsend_success : mapsend_failure;
+}
+
+void client_start_mapsave(client_t *client) {
+	worker_submit(jobpriority_normal, mapsend_job, client_mapsend_done, client);
 }
 
 void client_start_fast_mapsave(client_t *client) {
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
+	worker_submit(jobpriority_normal, mapsend_fast_job, client_mapsend_done, client);
+}
+
+// Sends everything that changed since the client's level snapshot was taken, once per position.
+void client_replay_changes(client_t *client) {
+	if (!client->has_snapshot) {
+		return;
+	}
 
-	pthread_t thread;
-	pthread_create(&thread, &attr, mapsend_fast_thread_start, client);
+	size_t num_changes;
+	uint32_t *indices = map_snapshot_changes(server.map, client->snapshot_seq, &num_changes);
+
+	if (num_changes > 0) {
+		blockchanges_t changes;
+		client_encode_block_changes(&changes, server.map, indices, num_changes);
+		client_send_block_changes(client, &changes);
+		client_free_block_changes(&changes);
+	}
+
+	free(indices);
+
+	map_snapshot_end(server.map, client->snapshot_seq);
+	client->has_snapshot = false;
 }
 
 void client_disconnect(client_t *client, const char *msg) {
 	if (client->connected) {
-		buffer_write_uint8(client->out_buffer, packet_player_disconnect);
-		buffer_write_mcstr(client->out_buffer, msg, client_supports_extension(client, "FullCP437", 1));
+		char reason[65];
+		packet_write_player_disconnect(client->out_buffer, packet_text(reason, msg, client_supports_extension(client, cpeext_full_cp437)));
 		client_flush(client);
 
-		if (client->using_websocket) {
+		if (client->connected && client->using_websocket) {
 			client_ws_disconnect(client, 1000);
 		}
 	}
 
 	client->connected = false;
 
-	if (client->spawned) {
+	if (client->spawned && client->spectator) {
+		client->spawned = false;
+		log_printf(log_info, "Spectator %s disconnected (%s)", client->name, msg);
+	}
+	else if (client->spawned) {
 		client->spawned = false;
 		server_broadcast("&e%s &fdisconnected (%s)", client->name, msg);
 
 		for (size_t i = 0; i < server.num_clients; i++) {
-			client_t *other = &server.clients[i];
-			if (other == client) {
-				continue;
+			client_t *other = server.clients[i];
+			if (other != client && other->views[(uint8_t)client->entity_id].visible) {
+				client_send_despawn(other, (uint8_t)client->entity_id);
+				client_flush(other);
 			}
-
-			buffer_write_uint8(other->out_buffer, packet_player_despawn);
-			buffer_write_int8(other->out_buffer, client->idx);
-			client_flush(other);
 		}
 	}
 }
 
-bool client_supports_extension(client_t *client, const char *name, int version) {
-	for (size_t i = 0; i < client->num_extensions; i++) {
-		if (strcasecmp(client->extensions[i].name, name) == 0 && client->extensions[i].version == version) {
-			return true;
-		}
-	}
-
-	return false;
-}
-
 void client_ws_upgrade(client_t *client, int r) {
-	client->in_buffer->mem.data[r + 1] = 0;
+	client->in_buffer->mem.data[r] = 0;
 
 	char *header_start = strstr((const char *)client->in_buffer->mem.data, "\r\n");
 	httpheaders_t headers;
@@ -762,13 +1143,14 @@ void client_ws_upgrade(client_t *client, int r) {
 		}
 
 		log_printf(log_info, "...actually using address %s", real_ip);
+		client->proxied = true;
 	}
 
 	const char *wskey = util_httpheaders_get(&headers, "Sec-WebSocket-Key");
 	char key[512];
 	snprintf(key, 512, "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", wskey);
 
-	unsigned char key_sha1[20];
+	unsigned char key_sha1[21]; // SHA1() terminates it
 	SHA1(key_sha1, key, strlen(key));
 
 	char *key_b64 = base64_enc_malloc(key_sha1, 20);
@@ -790,7 +1172,8 @@ void client_ws_upgrade(client_t *client, int r) {
 	buffer_write(client->out_buffer, response, strlen(response));
 	client_flush(client);
 	client->using_websocket = true;
-	client->ws_out_buffer = buffer_allocate_memory(BUFFER_SIZE + 4, false);
+	client->ws_out_buffer = buffer_create_chain();
+	client->ws_input = buffer_allocate_pooled(server.buffer_pool, 0);
 
 	free(key_b64);
 	util_httpheaders_destroy(&headers);
@@ -888,7 +1271,7 @@ void client_ws_decode_frame(client_t *client) {
 	switch (client->ws_opcode) {
 		case 0x00:
 		case 0x02: {
-			client_handle_in_buffer(client, client->ws_frame, client->ws_frame_len);
+			buffer_write(client->ws_input, client->ws_frame->mem.data, client->ws_frame_len);
 			break;
 		}
 
@@ -920,12 +1303,15 @@ void client_ws_wrap_packet(client_t *client, buffer_t *buffer) {
 		buffer_write_uint8(client->ws_out_buffer, data_len);
 	}
 
-	buffer_write(client->ws_out_buffer, buffer->mem.data, data_len);
+	buffer_write_ref(client->ws_out_buffer, buffer->mem.data, data_len);
 }
 
+// ws_out_buffer is shared with client_flush_buffer, which the level transfer thread may be running.
 void client_ws_disconnect(client_t *client, int code) {
+	pthread_mutex_lock(&client->out_mutex);
 	buffer_write_uint8(client->ws_out_buffer, 0x88);
 	buffer_write_uint8(client->ws_out_buffer, 0x02);
 	buffer_write_uint16be(client->ws_out_buffer, code);
 	client_send(client, client->ws_out_buffer);
+	pthread_mutex_unlock(&client->out_mutex);
 }
@@ -25,29 +25,67 @@ struct buffer_s;
 
 enum {
 	mapsend_none,
+	mapsend_queued,
 	mapsend_running,
 	mapsend_success,
 	mapsend_sent,
 	mapsend_failure
 };
 
+// What a client was last told about another player. Only players within view distance are spawned for
+// it, and movement is sent relative to the last position it got.
+typedef struct entityview_s {
+	bool visible;
+	bool known;
+	int16_t x, y, z;
+	int8_t yaw, pitch;
+	uint64_t seen_tick;
+	uint32_t generation; // of the entity id when it was spawned
+} entityview_t;
+
+// Refills at a fixed rate up to a limit, each block change takes one token.
+typedef struct tokenbucket_s {
+	double tokens;
+	double refilled; // when, in get_time_s() time
+} tokenbucket_t;
+
 typedef struct client_s {
 	socket_t socket_fd;
 	bool connected;
-	size_t idx;
+	const char *send_error; // why a write failed, the main thread disconnects the client for it
+	int entity_id; // -1 until logged in
 	bool is_op;
 
+	tokenbucket_t place_tokens, break_tokens;
+	uint32_t *rejected; // changes to undo on the client's side at the end of its input
+	size_t num_rejected, rejected_size;
+	uint64_t num_over_limit;
+
 	uint8_t address[4];
 	uint16_t port;
+	bool proxied; // address is a web proxy's, the player is somewhere behind it
 
 	uint8_t protocol_version;
 
-	struct buffer_s *in_buffer;
+	struct buffer_s *in_buffer; // starts with whatever the input budget held back last tick
 	struct buffer_s *out_buffer;
+	unsigned input_budget; // packets still allowed this tick
+	uint64_t throttled_ticks;
 	pthread_mutex_t out_mutex;
 
 	int mapsend_state;
 	struct buffer_s *mapgz_buffer;
+	bool has_snapshot;
+	uint64_t snapshot_seq;
+	uint64_t join_ticket;
+	size_t queue_position;
+	size_t mapsend_memory;
+	bool mapsend_streaming;
+	bool mapsend_ok;
+	int mapsend_level;
+	int mapsend_max_level; // from the load when the transfer was planned
+	struct levelcache_s *level_cache;
+	struct buffer_s *level_image;
 
 	double last_ping;
 	double ping;
@@ -55,12 +93,20 @@ typedef struct client_s {
 
 	char name[65];
 
-	bool spawned;
-	float x, y, z;
-	float yaw, pitch;
+	bool spawned; // its position is in server.poses, unless it's a spectator
+	bool spectator; // joined when the server was full of players, only watches
+	entityview_t views[256]; // by entity id
+
+	// Cell in server.players, linked while spawned.
+	bool in_grid;
+	size_t grid_cell;
+	struct client_s *grid_prev, *grid_next;
 
-	size_t num_extensions;
-	cpeext_t *extensions;
+	// Extensions both sides support at the same version, by cpeextid_t bit. Resolved once from the
+	// ExtEntry packets at login.
+	cpemask_t extensions;
+	int extension_versions[cpeext_count]; // as announced by the client, 0 if not
+	size_t pending_extensions;
 
 	int customblocks_support;
 
@@ -69,22 +115,57 @@ typedef struct client_s {
 	uint8_t ws_mask[4];
 	struct buffer_s *ws_frame;
 	struct buffer_s *ws_out_buffer;
+	struct buffer_s *ws_input; // unwrapped from frames, waiting to be handled
 } client_t;
 
-void client_init(client_t *client, int fd, size_t idx);
+void client_init(client_t *client, int fd);
 void client_destroy(client_t *client);
 void client_tick(client_t *client);
 void client_flush(client_t *client);
-void client_flush_buffer(client_t *client, struct buffer_s *buffer);
+void client_write_packets(client_t *client, const uint8_t *data, size_t len, size_t packet_size);
+void client_send_movement(client_t *observer, client_t *client);
+void client_send_spawn(client_t *observer, client_t *client);
+void client_send_despawn(client_t *observer, uint8_t id);
+bool client_flush_buffer(client_t *client, struct buffer_s *buffer);
 void client_disconnect(client_t *client, const char *msg);
 
-bool client_supports_extension(client_t *client, const char *name, int version);
-
-typedef struct {
-	client_t *client;
-	uint8_t *data;
-	size_t width, height, depth;
-} mapsend_t;
-
-void *mapsend_thread_start(void *data);
-void *mapsend_fast_thread_start(void *data);
+static inline bool client_supports_extension(const client_t *client, cpeextid_t ext) {
+	return (client->extensions & ((cpemask_t)1 << ext)) != 0;
+}
+
+void client_start_level(client_t *client);
+void client_notify_queue_position(client_t *client, size_t position);
+size_t client_level_memory_estimate(client_t *client);
+
+void mapsend_job(void *data);
+void mapsend_fast_job(void *data);
+size_t mapsend_memory_estimate(bool fastmap);
+void mapsend_update_pressure(size_t pending);
+void mapsend_plan(client_t *client, bool fastmap);
+int mapsend_adapt_level(int level, int max_level, double rate, double work, double wait);
+
+typedef struct levelcache_s {
+	uint64_t seq;
+	size_t refs;
+	struct buffer_s *image;
+} levelcache_t;
+
+void mapsend_cache_store(uint64_t seq, struct buffer_s *image);
+void mapsend_cache_release(levelcache_t *cache);
+void mapsend_cache_drop(void);
+void mapsend_cache_expire(void);
+
+struct map_s;
+void mapsend_benchmark(struct map_s *map);
+
+// A set of block changes encoded once for any number of clients: every change as a set block packet,
+// and the first num_bulk of them again as BulkBlockUpdate packets.
+typedef struct blockchanges_s {
+	struct buffer_s *single;
+	struct buffer_s *bulk;
+	size_t num_bulk;
+} blockchanges_t;
+
+void client_encode_block_changes(blockchanges_t *changes, struct map_s *map, const uint32_t *indices, size_t num);
+void client_free_block_changes(blockchanges_t *changes);
+void client_send_block_changes(client_t *client, const blockchanges_t *changes);
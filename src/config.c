@@ -239,6 +239,30 @@ void cfg_callback(const char *section, const char *key, const char *value) {
 				config.server.max_players = (unsigned int) max;
 			}
 		}
+		else if (strcmp(key, "max_connections") == 0) {
+			long max = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'max_connections' as unsigned integer");
+			} else {
+				config.server.max_connections = (unsigned int) max;
+			}
+		}
+		else if (strcmp(key, "max_spectators") == 0) {
+			long max = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'max_spectators' as unsigned integer");
+			} else {
+				config.server.max_spectators = (unsigned int) max;
+			}
+		}
+		else if (strcmp(key, "spectator_interval") == 0) {
+			long interval = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'spectator_interval' as unsigned integer");
+			} else {
+				config.server.spectator_interval = (unsigned int) interval;
+			}
+		}
 		else if (strcmp(key, "whitelist") == 0) {
 			config.server.enable_whitelist = strcmp(value, "true") == 0;
 		}
@@ -276,6 +300,119 @@ void cfg_callback(const char *section, const char *key, const char *value) {
 		else if (strcmp(key, "enable_old_clients") == 0) {
 			config.server.enable_old_clients = strcmp(value, "true") == 0;
 		}
+		else if (strcmp(key, "max_level_transfers") == 0) {
+			long max = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'max_level_transfers' as unsigned integer");
+			} else {
+				config.server.max_level_transfers = (unsigned int) max;
+			}
+		}
+		else if (strcmp(key, "level_transfer_memory") == 0) {
+			long size = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'level_transfer_memory' as unsigned integer");
+			} else {
+				config.server.level_transfer_memory = (unsigned int) size;
+			}
+		}
+		else if (strcmp(key, "level_encoder") == 0) {
+			if (strcmp(value, "zlib") == 0 || strcmp(value, "voxel") == 0) {
+				free(config.server.level_encoder);
+				config.server.level_encoder = strdup(value);
+			} else {
+				log_printf(log_error, "Unknown level encoder '%s', expected 'zlib' or 'voxel'", value);
+			}
+		}
+		else if (strcmp(key, "worker_threads") == 0) {
+			long count = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'worker_threads' as unsigned integer");
+			} else {
+				config.server.worker_threads = (unsigned int) count;
+			}
+		}
+		else if (strcmp(key, "view_distance") == 0) {
+			long distance = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'view_distance' as unsigned integer");
+			} else {
+				config.server.view_distance = (unsigned int) distance;
+			}
+		}
+		else if (strcmp(key, "far_player_distance") == 0) {
+			long distance = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'far_player_distance' as unsigned integer");
+			} else {
+				config.server.far_player_distance = (unsigned int) distance;
+			}
+		}
+		else if (strcmp(key, "far_player_interval") == 0) {
+			long interval = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'far_player_interval' as unsigned integer");
+			} else {
+				config.server.far_player_interval = (unsigned int) interval;
+			}
+		}
+		else if (strcmp(key, "input_budget") == 0) {
+			long budget = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'input_budget' as unsigned integer");
+			} else {
+				config.server.input_budget = (unsigned int) budget;
+			}
+		}
+		else if (strcmp(key, "tick_rate") == 0) {
+			long rate = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'tick_rate' as unsigned integer");
+			} else {
+				config.server.tick_rate = (unsigned int) rate;
+			}
+		}
+		else if (strcmp(key, "max_catch_up_ticks") == 0) {
+			long ticks = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'max_catch_up_ticks' as unsigned integer");
+			} else {
+				config.server.max_catch_up_ticks = (unsigned int) ticks;
+				config.server.max_catch_up_ticks_set = true;
+			}
+		}
+		else if (strcmp(key, "block_place_rate") == 0) {
+			long rate = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'block_place_rate' as unsigned integer");
+			} else {
+				config.server.block_place_rate = (unsigned int) rate;
+			}
+		}
+		else if (strcmp(key, "block_place_burst") == 0) {
+			long burst = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'block_place_burst' as unsigned integer");
+			} else {
+				config.server.block_place_burst = (unsigned int) burst;
+			}
+		}
+		else if (strcmp(key, "block_break_rate") == 0) {
+			long rate = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'block_break_rate' as unsigned integer");
+			} else {
+				config.server.block_break_rate = (unsigned int) rate;
+			}
+		}
+		else if (strcmp(key, "block_break_burst") == 0) {
+			long burst = parse_int(value, &ok, 10);
+			if (!ok) {
+				log_printf(log_error, "Failed to parse 'block_break_burst' as unsigned integer");
+			} else {
+				config.server.block_break_burst = (unsigned int) burst;
+			}
+		}
 	}
 
 	else if (strcmp(section, "map") == 0) {
@@ -309,6 +446,14 @@ void cfg_callback(const char *section, const char *key, const char *value) {
 		else if (strcmp(key, "generator") == 0) {
 			config.map.generator = strdup(value);
 		}
+		else if (strcmp(key, "storage") == 0) {
+			if (strcmp(value, "flat") == 0 || strcmp(value, "chunked") == 0 || strcmp(value, "mapped") == 0) {
+				free(config.map.storage);
+				config.map.storage = strdup(value);
+			} else {
+				log_printf(log_error, "Unknown level storage '%s', expected 'flat', 'chunked' or 'mapped'", value);
+			}
+		}
 		else if (strcmp(key, "seed") == 0) {
 			long seed = parse_int(value, &ok, 10);
 			if (!ok) {
@@ -405,6 +550,55 @@ void config_init(const char *config_path) {
 		config.server.max_players = 8;
 	}
 
+	if (config.server.max_connections == 0) {
+		config.server.max_connections = config.server.max_players + config.server.max_spectators + 32;
+	}
+
+	if (config.server.spectator_interval == 0) {
+		config.server.spectator_interval = 5;
+	}
+
+	if (config.server.max_level_transfers == 0) {
+		config.server.max_level_transfers = 4;
+	}
+
+	if (config.server.level_transfer_memory == 0) {
+		config.server.level_transfer_memory = 256;
+	}
+
+	// Transfers can occupy at most max_level_transfers workers, keep some free for everything else.
+	if (config.server.worker_threads == 0) {
+		config.server.worker_threads = config.server.max_level_transfers + 2;
+	}
+
+	if (config.server.level_encoder == NULL) {
+		config.server.level_encoder = strdup("zlib");
+	}
+
+	if (config.server.far_player_interval == 0) {
+		config.server.far_player_interval = 4;
+	}
+
+	if (config.server.input_budget == 0) {
+		config.server.input_budget = 64;
+	}
+
+	if (config.server.tick_rate == 0) {
+		config.server.tick_rate = 20;
+	}
+
+	if (!config.server.max_catch_up_ticks_set) {
+		config.server.max_catch_up_ticks = config.server.tick_rate / 2;
+	}
+
+	if (config.server.block_place_burst == 0) {
+		config.server.block_place_burst = config.server.block_place_rate;
+	}
+
+	if (config.server.block_break_burst == 0) {
+		config.server.block_break_burst = config.server.block_break_rate;
+	}
+
 	if (config.map.name == NULL) {
 		config.map.name = strdup("world");
 	}
@@ -428,6 +622,10 @@ void config_init(const char *config_path) {
 	if (config.map.image_path == NULL) {
 		config.map.image_path = strdup("");
 	}
+
+	if (config.map.storage == NULL) {
+		config.map.storage = strdup("flat");
+	}
 }
 
 void config_destroy(void) {
@@ -441,9 +639,11 @@ void config_destroy(void) {
 	
 	free(config.server.name);
 	free(config.server.motd);
+	free(config.server.level_encoder);
 	free(config.map.image_path);
 	free(config.map.name);
 	free(config.map.generator);
+	free(config.map.storage);
 
 	memset(&config, 0, sizeof(config));
 }
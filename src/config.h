@@ -31,8 +31,24 @@ typedef struct {
 		bool public;
 		bool offline;
 		unsigned max_players;
+		unsigned max_connections;
+		unsigned max_spectators;
+		unsigned spectator_interval;
 		bool enable_whitelist;
 		bool enable_old_clients;
+		unsigned max_level_transfers;
+		unsigned level_transfer_memory;
+		char *level_encoder;
+		unsigned worker_threads;
+		unsigned view_distance;
+		unsigned far_player_distance;
+		unsigned far_player_interval;
+		unsigned input_budget;
+		unsigned tick_rate; // ticks per second
+		unsigned max_catch_up_ticks;
+		bool max_catch_up_ticks_set; // so an explicit 0 isn't taken for the default
+		unsigned block_place_rate, block_place_burst;
+		unsigned block_break_rate, block_break_burst;
 
 		char **allowed_web_proxies;
 		size_t num_proxies;
@@ -42,6 +58,7 @@ typedef struct {
 		char *name;
 		unsigned width, depth, height;
 		char *generator;
+		char *storage;
 		bool random_seed;
 		int seed;
 		char *image_path;
@@ -15,23 +15,24 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include <stddef.h>
-#include <stdbool.h>
+#include <string.h>
 #include "cpe.h"
 
-cpeext_t supported_extensions[] = {
-		{ "FullCP437", 1 },
-		{ "FastMap", 1 },
-		{ "CustomBlocks", 1 },
-		{ "TwoWayPing", 1 },
-		{ "TextColors", 1 },
-
-		{ "", 0 }
+cpeext_t supported_extensions[cpeext_count] = {
+		[cpeext_full_cp437] = { "FullCP437", 1 },
+		[cpeext_fast_map] = { "FastMap", 1 },
+		[cpeext_custom_blocks] = { "CustomBlocks", 1 },
+		[cpeext_two_way_ping] = { "TwoWayPing", 1 },
+		[cpeext_text_colors] = { "TextColors", 1 },
+		[cpeext_bulk_block_update] = { "BulkBlockUpdate", 1 },
 };
 
-size_t cpe_count_supported(void) {
-	for (size_t i = 0; true; i++) {
-		if (supported_extensions[i].name[0] == '\0') {
+int cpe_find(const char *name) {
+	for (int i = 0; i < cpeext_count; i++) {
+		if (strcasecmp(supported_extensions[i].name, name) == 0) {
 			return i;
 		}
 	}
+
+	return -1;
 }
@@ -16,12 +16,29 @@
 
 #pragma once
 
+#include <stdint.h>
+
+// Index into supported_extensions, and the bit a client gets in its extension mask.
+typedef enum {
+	cpeext_full_cp437,
+	cpeext_fast_map,
+	cpeext_custom_blocks,
+	cpeext_two_way_ping,
+	cpeext_text_colors,
+	cpeext_bulk_block_update,
+
+	cpeext_count
+} cpeextid_t;
+
+typedef uint32_t cpemask_t;
+
 typedef struct {
 	char name[65];
 	int version;
 } cpeext_t;
 
-extern cpeext_t supported_extensions[];
+extern cpeext_t supported_extensions[cpeext_count];
 
-size_t cpe_count_supported(void);
+// Returns the extension with the given name, or -1 if the server doesn't implement it.
+int cpe_find(const char *name);
 
@@ -16,7 +16,6 @@
 
 #include <stdio.h>
 #include <inttypes.h>
-#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include "server.h"
@@ -25,6 +24,7 @@
 #include "util.h"
 #include "log.h"
 #include "version.h"
+#include "worker.h"
 
 #ifndef _WIN32
 #include <sys/types.h>
@@ -33,7 +33,7 @@
 
 static bool heartbeat_url_printed = false;
 
-static void *heartbeat_main(void *data) {
+static void heartbeat_main(void *data) {
 	(void)data;
 
 	char url[2048];
@@ -47,7 +47,7 @@ static void *heartbeat_main(void *data) {
 			 config.server.max_players,
 			 config.server.public ? "True" : "False",
 			 server.salt,
-			 server.num_clients,
+			 slottable_used(server.entities),
 			 "Thirty", HG_CHANGESET_HASH,
 			 config.server.name,
 			 HG_CHANGESET_HASH
@@ -61,7 +61,7 @@ static void *heartbeat_main(void *data) {
 	int err = getaddrinfo("www.classicube.net", "80", &hints, &result);
 	if (err != 0) {
 		log_printf(log_error, "getaddrinfo error: %d", err);
-		return NULL;
+		return;
 	}
 
 	socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -118,8 +118,6 @@ static void *heartbeat_main(void *data) {
 cleanup:
 	closesocket(sock);
 	freeaddrinfo(result);
-
-	return NULL;
 }
 
 void server_heartbeat(void) {
@@ -127,9 +125,5 @@ void server_heartbeat(void) {
 		return;
 	}
 
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-
-	pthread_t thread;
-	pthread_create(&thread, &attr, heartbeat_main, NULL);
+	worker_submit(jobpriority_high, heartbeat_main, NULL, NULL);
 }
@@ -16,10 +16,15 @@
 
 #include <signal.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <getopt.h>
 #include "server.h"
+#include "client.h"
+#include "map.h"
+#include "mapgen.h"
 #include "sockets.h"
 #include "blocks.h"
 #include "util.h"
@@ -28,6 +33,7 @@
 #include "version.h"
 
 static void signal_handler(int signum);
+static void run_ticks(void);
 
 static bool running = true;
 
@@ -37,8 +43,9 @@ int main(int argc, char *argv[]) {
 	setbuf(stdout, NULL);
 
 	const char *config_file = NULL;
+	bool benchmark = false;
 	int opt;
-	while ((opt = getopt(argc, argv, "Cc:")) != -1) {
+	while ((opt = getopt(argc, argv, "Cc:b")) != -1) {
 		switch (opt) {
 			case 'C': {
 				args_disable_colour = true;
@@ -50,8 +57,13 @@ int main(int argc, char *argv[]) {
 				break;
 			}
 
+			case 'b': {
+				benchmark = true;
+				break;
+			}
+
 			default: {
-				printf("Usage: %s [-C] [-c config]\n", argv[0]);
+				printf("Usage: %s [-C] [-c config] [-b]\n", argv[0]);
 				return 0;
 			}
 		}
@@ -63,6 +75,21 @@ int main(int argc, char *argv[]) {
 	config_init(config_file);
 	blocks_init();
 
+	if (benchmark) {
+		map_t *map = map_load(config.map.name);
+		if (map == NULL) {
+			map = map_create(config.map.name, config.map.width, config.map.depth, config.map.height);
+			map_generate(map, config.map.generator);
+		}
+
+		mapsend_benchmark(map);
+
+		map_destroy(map);
+		config_destroy();
+		log_shutdown();
+		return 0;
+	}
+
 #ifdef _WIN32
 	{
 		WSADATA wsadata;
@@ -77,16 +104,7 @@ int main(int argc, char *argv[]) {
 
 	log_printf(log_info, "Ready!");
 
-	while (running) {
-		double start = get_time_s();
-		server_tick();
-		double end = get_time_s();
-		if (end - start > 1.0 / 20.0) {
-			log_printf(log_info, "Server lagged: Tick %" PRIu64 " took too long (%f ms)", server.tick - 1, (end - start) * 1000.0);
-		}
-
-		usleep(1000000 / 20);
-	}
+	run_ticks();
 
 	server_shutdown();
 	config_destroy();
@@ -99,6 +117,97 @@ int main(int argc, char *argv[]) {
 	return 0;
 }
 
+static void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+	ns += (uint64_t)ts->tv_nsec;
+	ts->tv_sec += (time_t)(ns / 1000000000);
+	ts->tv_nsec = (long)(ns % 1000000000);
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b) {
+	return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+static void sleep_until(const struct timespec *deadline) {
+#ifdef TIMER_ABSTIME
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR && running) {
+	}
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const int64_t left = timespec_diff_ns(deadline, &now);
+	if (left > 0) {
+		usleep((useconds_t)(left / 1000));
+	}
+#endif
+}
+
+// Ticks start on a fixed schedule of tick_rate per second, however long each one takes. A tick that
+// overruns makes the following ones start straight away until the server has caught up, but it's never
+// more than max_catch_up_ticks behind: ticks missed beyond that are skipped, slowing the game down
+// rather than stalling it for a long burst of ticks.
+static void run_ticks(void) {
+	const uint64_t period = 1000000000 / config.server.tick_rate;
+	const uint64_t max_behind = config.server.max_catch_up_ticks;
+	const uint64_t report_interval = (uint64_t)config.server.tick_rate * 10;
+
+	struct timespec deadline, last_start;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	last_start = deadline;
+
+	// Lag over the current reporting interval.
+	uint64_t report_tick = server.tick, late = 0, skipped = 0;
+	double busy = 0.0, elapsed = 0.0, slowest = 0.0;
+	size_t throttled = 0;
+
+	while (running) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		server_tick();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		const double duration = (double)timespec_diff_ns(&end, &start) / 1000000000.0;
+		const double since_last = (double)timespec_diff_ns(&start, &last_start) / 1000000000.0;
+		server.tick_time += (duration - server.tick_time) * 0.1;
+		last_start = start;
+
+		busy += duration;
+		elapsed += since_last;
+		slowest = util_max(slowest, duration);
+		throttled = util_max(throttled, server.throttled_clients);
+
+		timespec_add_ns(&deadline, period);
+		const int64_t behind = timespec_diff_ns(&end, &deadline);
+		if (behind < 0) {
+			sleep_until(&deadline);
+		}
+		else {
+			late++;
+			const uint64_t missed = (uint64_t)behind / period;
+			if (missed > max_behind) {
+				timespec_add_ns(&deadline, (missed - max_behind) * period);
+				server.skipped_ticks += missed - max_behind;
+				skipped += missed - max_behind;
+			}
+		}
+
+		const uint64_t ticks = server.tick - report_tick;
+		if (ticks >= report_interval) {
+			if (late > 0) {
+				log_printf(log_info, "Server lagged: %" PRIu64 " of the last %" PRIu64 " ticks started late, %" PRIu64 " skipped (%" PRIu64 " in total). Ticks took %.2f ms on average and %.2f ms at most, and started every %.2f ms on average (aiming for %.2f ms). Up to %zu clients throttled.",
+					late, ticks, skipped, server.skipped_ticks, busy * 1000.0 / ticks, slowest * 1000.0, elapsed * 1000.0 / ticks, (double)period / 1000000.0, throttled);
+			}
+
+			report_tick = server.tick;
+			late = 0;
+			skipped = 0;
+			busy = 0.0;
+			elapsed = 0.0;
+			slowest = 0.0;
+			throttled = 0;
+		}
+	}
+}
+
 void signal_handler(int signum) {
 	log_printf(log_info, "Received signal %d, will exit.", signum);
 	running = false;
@@ -18,47 +18,226 @@
 #include <string.h>
 #include "map.h"
 #include "mapgen.h"
-#include "buffer.h"
 #include "server.h"
-#include "client.h"
-#include "packet.h"
 #include "blocks.h"
 #include "config.h"
 #include "mapimage.h"
 #include "rng.h"
 #include "util.h"
+#include "log.h"
 
-map_t *map_create(const char *name, size_t width, size_t depth, size_t height) {
+static uint32_t map_tick_hash(map_t *map, uint32_t index) {
+	return (index * 2654435761u) >> (32 - map->tick_hash_bits);
+}
+
+static void map_rehash_ticks(map_t *map, unsigned bits) {
+	map->tick_hash_bits = bits;
+	map->tick_hash = realloc(map->tick_hash, sizeof(*map->tick_hash) << bits);
+	memset(map->tick_hash, 0xFF, sizeof(*map->tick_hash) << bits);
+
+	for (size_t slot = 0; slot <= TICKWHEEL_SIZE; slot++) {
+		for (uint32_t n = map->wheel[slot].head; n != TICK_NONE; n = map->ticks[n].next) {
+			const uint32_t h = map_tick_hash(map, map->ticks[n].index);
+			map->ticks[n].hash_next = map->tick_hash[h];
+			map->tick_hash[h] = n;
+		}
+	}
+}
+
+static void map_forget_columns(map_t *map) {
+	memset(map->column_top, 0xFF, sizeof(*map->column_top) * map->width * map->height);
+	memset(map->column_top_lit, 0xFF, sizeof(*map->column_top_lit) * map->width * map->height);
+}
+
+static map_t *map_alloc(const char *name, size_t width, size_t depth, size_t height, bool keep) {
 	map_t *map = malloc(sizeof(*map));
 	map->name = strdup(name);
 	map->width = width;
 	map->depth = depth;
 	map->height = height;
-	map->blocks = malloc(width * depth * height);
+	map->blocks = NULL;
+	map->chunks = NULL;
+	map->mapping = NULL;
+	map->mapping_size = 0;
+	map->mapping_fd = -1;
+	map->column_top = malloc(sizeof(*map->column_top) * width * height);
+	map->column_top_lit = malloc(sizeof(*map->column_top_lit) * width * height);
+	map_forget_columns(map);
+	map->random_tick_counts = NULL;
+	map->chunks_x = (width + MAPCHUNK_MASK) >> MAPCHUNK_SHIFT;
+	map->chunks_y = (depth + MAPCHUNK_MASK) >> MAPCHUNK_SHIFT;
+	map->chunks_z = (height + MAPCHUNK_MASK) >> MAPCHUNK_SHIFT;
 	map->generating = false;
 	map->num_ticks = 0;
+	map->ticks_size = 0;
 	map->ticks = NULL;
+	map->free_tick = TICK_NONE;
+	for (size_t i = 0; i <= TICKWHEEL_SIZE; i++) {
+		map->wheel[i].head = map->wheel[i].tail = TICK_NONE;
+	}
+	map->wheel_tick = server.tick;
+	map->tick_hash = NULL;
+	map_rehash_ticks(map, 8);
 	map->modified = true;
+	map->change_seq = 0;
+	map->changes_base = 0;
+	map->num_changes = 0;
+	map->changes_size = 0;
+	map->changes = NULL;
+	map->num_snapshots = 0;
+	map->snapshots = NULL;
+	map->num_dirty = 0;
+	map->dirty_size = 0;
+	map->dirty = NULL;
+
+	if (strcmp(config.map.storage, "mapped") == 0) {
+		if (!map_sidecar_attach(map, keep)) {
+			log_printf(log_error, "Falling back to flat level storage");
+			map->blocks = calloc(width * depth * height, 1);
+		}
+	}
+	else if (strcmp(config.map.storage, "chunked") == 0) {
+		const size_t num_chunks = map->chunks_x * map->chunks_y * map->chunks_z;
+		map->chunks = malloc(sizeof(*map->chunks) * num_chunks);
+		for (size_t i = 0; i < num_chunks; i++) {
+			mapchunk_init(&map->chunks[i], air);
+		}
+	}
+	else {
+		map->blocks = calloc(width * depth * height, 1);
+	}
 
-	memset(map->blocks, 0, width * depth * height);
+	pthread_mutex_init(&map->changes_mutex, NULL);
+	pthread_rwlock_init(&map->chunks_lock, NULL);
 
 	return map;
 }
 
+map_t *map_create(const char *name, size_t width, size_t depth, size_t height) {
+	return map_alloc(name, width, depth, height, false);
+}
+
+map_t *map_reopen(const char *name, size_t width, size_t depth, size_t height) {
+	return map_alloc(name, width, depth, height, true);
+}
+
 void map_destroy(map_t *map) {
+	if (map->chunks != NULL) {
+		for (size_t i = 0; i < map->chunks_x * map->chunks_y * map->chunks_z; i++) {
+			mapchunk_free(&map->chunks[i]);
+		}
+		free(map->chunks);
+	}
+
+	if (map->mapping != NULL) {
+		map_sidecar_detach(map);
+	}
+
+	pthread_rwlock_destroy(&map->chunks_lock);
+	pthread_mutex_destroy(&map->changes_mutex);
+	free(map->dirty);
+	free(map->snapshots);
+	free(map->changes);
+	free(map->tick_hash);
+	free(map->ticks);
+	free(map->random_tick_counts);
+	free(map->column_top_lit);
+	free(map->column_top);
 	free(map->name);
 	free(map->blocks);
 	free(map);
 }
 
+static inline size_t map_chunk_index(map_t *map, size_t x, size_t y, size_t z) {
+	return ((y >> MAPCHUNK_SHIFT) * map->chunks_z + (z >> MAPCHUNK_SHIFT)) * map->chunks_x + (x >> MAPCHUNK_SHIFT);
+}
+
+static inline mapchunk_t *map_chunk(map_t *map, size_t x, size_t y, size_t z) {
+	return &map->chunks[map_chunk_index(map, x, y, z)];
+}
+
+// Scans down from y for the top of a column. Only needed the first time a column is asked about and
+// when its top block is removed, every other change can be applied directly.
+static uint16_t map_scan_top(map_t *map, size_t x, size_t y, size_t z, bool lit) {
+	for (; y > 0; y--) {
+		const uint8_t block = map_get(map, x, y, z);
+		if (lit ? blockinfo[block].block_light : block != air) {
+			break;
+		}
+	}
+
+	return (uint16_t)y;
+}
+
+static void map_update_column(map_t *map, uint16_t *top, size_t x, size_t y, size_t z, bool solid, bool lit) {
+	if (*top == MAP_COLUMN_UNKNOWN) {
+		return;
+	}
+
+	if (solid && y > *top) {
+		*top = (uint16_t)y;
+	}
+	else if (!solid && y == *top && y > 0) {
+		*top = map_scan_top(map, x, y - 1, z, lit);
+	}
+}
+
+static void map_store_block(map_t *map, size_t index, size_t x, size_t y, size_t z, uint8_t block) {
+	if (map->blocks != NULL) {
+		map->blocks[index] = block;
+		return;
+	}
+
+	mapchunk_t *chunk = map_chunk(map, x, y, z);
+	const unsigned i = mapchunk_index(x, y, z);
+
+	if (!mapchunk_try_set(chunk, i, block)) {
+		pthread_rwlock_wrlock(&map->chunks_lock);
+		mapchunk_set_slow(chunk, i, block);
+		pthread_rwlock_unlock(&map->chunks_lock);
+	}
+}
+
+static void map_store(map_t *map, size_t index, size_t x, size_t y, size_t z, uint8_t block) {
+	if (map->random_tick_counts != NULL) {
+		const bool was_random = blockinfo[map_get_index(map, index)].random_tickfunc != NULL;
+		const bool is_random = blockinfo[block].random_tickfunc != NULL;
+		if (was_random != is_random) {
+			map->random_tick_counts[map_chunk_index(map, x, y, z)] += is_random ? 1 : -1;
+		}
+	}
+
+	map_store_block(map, index, x, y, z, block);
+
+	const size_t column = z * map->width + x;
+	map_update_column(map, &map->column_top[column], x, y, z, block != air, false);
+	map_update_column(map, &map->column_top_lit[column], x, y, z, blockinfo[block].block_light, true);
+}
+
 void map_set(map_t *map, size_t x, size_t y, size_t z, uint8_t block) {
 	if (!map_pos_valid(map, x, y, z) || map_get(map, x, y, z) == block) {
 		return;
 	}
 
 	const uint8_t old_block = map_get(map, x, y, z);
+	const size_t index = map_get_block_index(map, x, y, z);
 
-	map->blocks[map_get_block_index(map, x, y, z)] = block;
+	// The change has to be logged before the block is written, so a snapshot reader that sees the
+	// new value is guaranteed to find the entry that undoes it.
+	if (map->num_snapshots > 0) {
+		pthread_mutex_lock(&map->changes_mutex);
+		if (map->num_changes == map->changes_size) {
+			map->changes_size = map->changes_size == 0 ? 256 : map->changes_size * 2;
+			map->changes = realloc(map->changes, sizeof(*map->changes) * map->changes_size);
+		}
+		map->changes[map->num_changes].index = (uint32_t)index;
+		map->changes[map->num_changes].old_block = old_block;
+		map->num_changes++;
+		pthread_mutex_unlock(&map->changes_mutex);
+	}
+
+	map->change_seq++;
+	map_store(map, index, x, y, z, block);
 
 	if (!map->generating) {
 		if (blockinfo[old_block].breakfunc != NULL) {
@@ -80,89 +259,212 @@ void map_set(map_t *map, size_t x, size_t y, size_t z, uint8_t block) {
 		map_add_tick(map, x, y, z + 1, dist);
 	}
 
-	for (size_t i = 0; i < server.num_clients; i++) {
-		client_t *client = &server.clients[i];
-		buffer_write_uint8(client->out_buffer, packet_set_block_server);
-		buffer_write_uint16be(client->out_buffer, x);
-		buffer_write_uint16be(client->out_buffer, y);
-		buffer_write_uint16be(client->out_buffer, z);
-		buffer_write_uint8(client->out_buffer, map_get(map, x, y, z));
+	// Clients are told at the end of the tick, once per position however often it changed.
+	if (server.num_clients > 0) {
+		if (map->num_dirty == map->dirty_size) {
+			map->dirty_size = map->dirty_size == 0 ? 256 : map->dirty_size * 2;
+			map->dirty = realloc(map->dirty, sizeof(*map->dirty) * map->dirty_size);
+		}
+		map->dirty[map->num_dirty++] = (uint32_t)index;
 	}
 
 	map->modified = true;
 }
 
 uint8_t map_get(map_t *map, size_t x, size_t y, size_t z) {
-	return map->blocks[map_get_block_index(map, x, y, z)];
+	// Generators probe past the edges of the level, treat that as air rather than reading whatever is there.
+	if (!map_pos_valid(map, x, y, z)) {
+		return air;
+	}
+
+	if (map->blocks != NULL) {
+		return map->blocks[map_get_block_index(map, x, y, z)];
+	}
+
+	return mapchunk_get(map_chunk(map, x, y, z), mapchunk_index(x, y, z));
 }
 
-size_t map_get_top(map_t *map, size_t x, size_t z) {
-	size_t yy;
+uint8_t map_get_index(map_t *map, size_t index) {
+	if (map->blocks != NULL) {
+		return map->blocks[index];
+	}
 
-	for (yy = map->depth - 1; yy > 0; yy--) {
-		const uint8_t block = map_get(map, x, yy, z);
-		if (block != air) {
-			break;
-		}
+	size_t x, y, z;
+	map_index_to_pos(map, index, &x, &y, &z);
+	return mapchunk_get(map_chunk(map, x, y, z), mapchunk_index(x, y, z));
+}
+
+// Stores a block with none of map_set()'s side effects, for generators.
+void map_set_index(map_t *map, size_t index, uint8_t block) {
+	size_t x, y, z;
+	map_index_to_pos(map, index, &x, &y, &z);
+	map_store(map, index, x, y, z, block);
+}
+
+size_t map_get_top(map_t *map, size_t x, size_t z) {
+	uint16_t *top = &map->column_top[z * map->width + x];
+	if (*top == MAP_COLUMN_UNKNOWN) {
+		*top = map_scan_top(map, x, map->depth - 1, z, false);
 	}
 
-	return yy;
+	return *top;
 }
 
 size_t map_get_top_lit(map_t *map, size_t x, size_t z) {
-	size_t yy;
+	uint16_t *top = &map->column_top_lit[z * map->width + x];
+	if (*top == MAP_COLUMN_UNKNOWN) {
+		*top = map_scan_top(map, x, map->depth - 1, z, true);
+	}
 
-	for (yy = map->depth - 1; yy > 0; yy--) {
-		const uint8_t block = map_get(map, x, yy, z);
-		if (blockinfo[block].block_light) {
-			break;
-		}
+	return *top;
+}
+
+static void map_link_tick(map_t *map, uint32_t n) {
+	scheduledtick_t *tick = &map->ticks[n];
+	tickslot_t *list = &map->wheel[tick->time & TICKWHEEL_MASK];
+
+	tick->slot = (uint32_t)(tick->time & TICKWHEEL_MASK);
+	tick->next = TICK_NONE;
+	tick->prev = list->tail;
+	if (list->tail != TICK_NONE) {
+		map->ticks[list->tail].next = n;
 	}
+	else {
+		list->head = n;
+	}
+	list->tail = n;
+}
+
+static void map_unlink_tick(map_t *map, uint32_t n) {
+	scheduledtick_t *tick = &map->ticks[n];
+	tickslot_t *list = &map->wheel[tick->slot];
 
-	return yy;
+	if (tick->prev != TICK_NONE) {
+		map->ticks[tick->prev].next = tick->next;
+	}
+	else {
+		list->head = tick->next;
+	}
+
+	if (tick->next != TICK_NONE) {
+		map->ticks[tick->next].prev = tick->prev;
+	}
+	else {
+		list->tail = tick->prev;
+	}
 }
 
-void map_tick(map_t *map) {
-	bool resized = false;
+static void map_free_tick(map_t *map, uint32_t n) {
+	uint32_t *link = &map->tick_hash[map_tick_hash(map, map->ticks[n].index)];
+	while (*link != n) {
+		link = &map->ticks[*link].hash_next;
+	}
+	*link = map->ticks[n].hash_next;
+
+	map_unlink_tick(map, n);
+	map->ticks[n].next = map->free_tick;
+	map->free_tick = n;
+	map->num_ticks--;
+}
 
-	size_t random_ticks = (map->width * map->depth * map->height) / (16 * 16 * 16);
-	for (size_t i = 0; i < random_ticks; i++) {
-		size_t x = rng_next(server.global_rng, map->width);
-		size_t y = rng_next(server.global_rng, map->depth);
-		size_t z = rng_next(server.global_rng, map->height);
-		uint8_t block = map_get(map, x, y, z);
-		if (blockinfo[block].random_tickfunc != NULL) {
-			blockinfo[block].random_tickfunc(map, x, y, z, block);
+// Counts the randomly ticked blocks in every chunk, from then on map_store() keeps the counts.
+static void map_count_random_ticks(map_t *map) {
+	map->random_tick_counts = calloc(map->chunks_x * map->chunks_y * map->chunks_z, sizeof(*map->random_tick_counts));
+
+	uint8_t *layer = malloc(map->width * map->height);
+	for (size_t y = 0; y < map->depth; y++) {
+		map_read_blocks(map, y * map->width * map->height, layer, map->width * map->height);
+
+		for (size_t z = 0; z < map->height; z++)
+		for (size_t x = 0; x < map->width; x++) {
+			if (blockinfo[layer[z * map->width + x]].random_tickfunc != NULL) {
+				map->random_tick_counts[map_chunk_index(map, x, y, z)]++;
+			}
 		}
 	}
+	free(layer);
+}
+
+void map_tick(map_t *map) {
+	if (map->random_tick_counts == NULL) {
+		map_count_random_ticks(map);
+	}
 
-	for (size_t i = 0; i < map->num_ticks; i++) {
-		scheduledtick_t *tick = &map->ticks[i];
-		if (server.tick < tick->time) {
+	// The same rate per block as picking volume / 4096 random positions in the whole level, but chunks
+	// without anything to tick are never visited.
+	const size_t volume = map->width * map->depth * map->height;
+	const float rate = (float)(volume / (16 * 16 * 16)) / (float)volume;
+
+	size_t chunk = 0;
+	for (size_t cy = 0; cy < map->chunks_y; cy++)
+	for (size_t cz = 0; cz < map->chunks_z; cz++)
+	for (size_t cx = 0; cx < map->chunks_x; cx++, chunk++) {
+		if (map->random_tick_counts[chunk] == 0) {
 			continue;
 		}
 
-		uint8_t block = map_get(map, tick->x, tick->y, tick->z);
-		if (blockinfo[block].tickfunc != NULL) {
-			blockinfo[block].tickfunc(map, tick->x, tick->y, tick->z, block);
+		const size_t x0 = cx << MAPCHUNK_SHIFT, y0 = cy << MAPCHUNK_SHIFT, z0 = cz << MAPCHUNK_SHIFT;
+		const int xn = (int)util_min(MAPCHUNK_SIZE, map->width - x0);
+		const int yn = (int)util_min(MAPCHUNK_SIZE, map->depth - y0);
+		const int zn = (int)util_min(MAPCHUNK_SIZE, map->height - z0);
+
+		const size_t samples = (size_t)(rate * (float)(xn * yn * zn) + rng_next_float(server.global_rng));
+		for (size_t i = 0; i < samples; i++) {
+			size_t x = x0 + rng_next(server.global_rng, xn);
+			size_t y = y0 + rng_next(server.global_rng, yn);
+			size_t z = z0 + rng_next(server.global_rng, zn);
+			uint8_t block = map_get(map, x, y, z);
+			if (blockinfo[block].random_tickfunc != NULL) {
+				blockinfo[block].random_tickfunc(map, x, y, z, block);
+			}
 		}
+	}
 
-		memmove(map->ticks + i, map->ticks + i + 1, (map->num_ticks - i - 1) * sizeof(*map->ticks));
-		map->num_ticks--;
-		resized = true;
+	// Only the last lap of the wheel can hold anything due if the server fell far behind.
+	if (server.tick > map->wheel_tick + TICKWHEEL_SIZE) {
+		map->wheel_tick = server.tick - TICKWHEEL_SIZE;
 	}
 
-	if (resized) {
-		if (map->num_ticks == 0) {
-			free(map->ticks);
-			map->ticks = 0;
-		}
-		else {
-			map->ticks = realloc(map->ticks, sizeof(*map->ticks) * map->num_ticks);
+	tickslot_t *running = &map->wheel[TICKWHEEL_SIZE];
+	for (; map->wheel_tick <= server.tick; map->wheel_tick++) {
+		tickslot_t *slot = &map->wheel[map->wheel_tick & TICKWHEEL_MASK];
+
+		// Ticks that are run can schedule more for the same tick (falling sand does), those land at the
+		// back of the slot again, so keep taking the slot over until a pass runs nothing.
+		bool ran = true;
+		while (ran && slot->head != TICK_NONE) {
+			for (uint32_t n = slot->head; n != TICK_NONE; n = map->ticks[n].next) {
+				map->ticks[n].slot = TICKWHEEL_SIZE;
+			}
+			*running = *slot;
+			slot->head = slot->tail = TICK_NONE;
+
+			ran = false;
+			while (running->head != TICK_NONE) {
+				const uint32_t n = running->head;
+				scheduledtick_t *tick = &map->ticks[n];
+
+				// A later lap of the wheel.
+				if (tick->time > map->wheel_tick) {
+					map_unlink_tick(map, n);
+					map_link_tick(map, n);
+					continue;
+				}
+
+				size_t x, y, z;
+				map_index_to_pos(map, tick->index, &x, &y, &z);
+				map_free_tick(map, n);
+
+				uint8_t block = map_get(map, x, y, z);
+				if (blockinfo[block].tickfunc != NULL) {
+					blockinfo[block].tickfunc(map, x, y, z, block);
+				}
+				ran = true;
+			}
 		}
 	}
 
-	int image_interval = config.map.image_interval * 20;
+	int image_interval = config.map.image_interval * config.server.tick_rate;
 	if (image_interval > 0 && server.tick % image_interval == 0) {
 		map_save_image_threaded(map, config.map.image_path);
 	}
@@ -178,10 +480,273 @@ void map_add_tick(map_t *map, size_t x, size_t y, size_t z, uint64_t num_ticks_u
 		return;
 	}
 
-	size_t idx = map->num_ticks++;
-	map->ticks = realloc(map->ticks, sizeof(*map->ticks) * map->num_ticks);
-	map->ticks[idx].x = x;
-	map->ticks[idx].y = y;
-	map->ticks[idx].z = z;
-	map->ticks[idx].time = server.tick + num_ticks_until;
+	const uint32_t index = (uint32_t)map_get_block_index(map, x, y, z);
+	const uint64_t time = util_max(server.tick + num_ticks_until, map->wheel_tick);
+
+	// A block only needs one pending tick, the earliest asked for.
+	for (uint32_t n = map->tick_hash[map_tick_hash(map, index)]; n != TICK_NONE; n = map->ticks[n].hash_next) {
+		scheduledtick_t *tick = &map->ticks[n];
+		if (tick->index == index) {
+			if (time < tick->time) {
+				map_unlink_tick(map, n);
+				tick->time = time;
+				map_link_tick(map, n);
+			}
+			return;
+		}
+	}
+
+	if (map->free_tick == TICK_NONE) {
+		const size_t old_size = map->ticks_size;
+		map->ticks_size = old_size == 0 ? 256 : old_size * 2;
+		map->ticks = realloc(map->ticks, sizeof(*map->ticks) * map->ticks_size);
+		for (size_t i = map->ticks_size; i > old_size; i--) {
+			map->ticks[i - 1].next = map->free_tick;
+			map->free_tick = (uint32_t)(i - 1);
+		}
+	}
+
+	const uint32_t n = map->free_tick;
+	scheduledtick_t *tick = &map->ticks[n];
+	map->free_tick = tick->next;
+	tick->index = index;
+	tick->time = time;
+	map_link_tick(map, n);
+
+	if (++map->num_ticks > ((size_t)1 << map->tick_hash_bits)) {
+		map_rehash_ticks(map, map->tick_hash_bits + 1);
+	}
+	else {
+		const uint32_t h = map_tick_hash(map, index);
+		tick->hash_next = map->tick_hash[h];
+		map->tick_hash[h] = n;
+	}
+}
+
+// Fills indices and times (num_ticks entries each) with the pending ticks, times relative to now.
+void map_list_ticks(map_t *map, int32_t *indices, int32_t *times) {
+	size_t i = 0;
+	for (size_t slot = 0; slot <= TICKWHEEL_SIZE; slot++) {
+		for (uint32_t n = map->wheel[slot].head; n != TICK_NONE; n = map->ticks[n].next) {
+			indices[i] = (int32_t)map->ticks[n].index;
+			times[i] = (int32_t)(map->ticks[n].time - server.tick);
+			i++;
+		}
+	}
+}
+
+uint64_t map_snapshot_begin(map_t *map) {
+	if (map->num_snapshots == 0) {
+		map->changes_base = map->change_seq;
+	}
+
+	map_snapshot_retain(map, map->change_seq);
+	return map->change_seq;
+}
+
+// Takes another reference to a snapshot that is still held, so the log isn't trimmed past it.
+void map_snapshot_retain(map_t *map, uint64_t seq) {
+	size_t idx = map->num_snapshots++;
+	map->snapshots = realloc(map->snapshots, sizeof(*map->snapshots) * map->num_snapshots);
+	map->snapshots[idx] = seq;
+}
+
+void map_snapshot_end(map_t *map, uint64_t seq) {
+	size_t i;
+	for (i = 0; i < map->num_snapshots; i++) {
+		if (map->snapshots[i] == seq) {
+			break;
+		}
+	}
+
+	if (i == map->num_snapshots) {
+		return;
+	}
+
+	memmove(map->snapshots + i, map->snapshots + i + 1, (map->num_snapshots - i - 1) * sizeof(*map->snapshots));
+	map->num_snapshots--;
+
+	// Drop whatever no remaining snapshot can see any more.
+	uint64_t oldest = map->change_seq;
+	for (i = 0; i < map->num_snapshots; i++) {
+		oldest = util_min(oldest, map->snapshots[i]);
+	}
+
+	pthread_mutex_lock(&map->changes_mutex);
+	size_t drop = (size_t)(oldest - map->changes_base);
+	memmove(map->changes, map->changes + drop, (map->num_changes - drop) * sizeof(*map->changes));
+	map->num_changes -= drop;
+	map->changes_base = oldest;
+
+	if (map->num_changes == 0) {
+		free(map->changes);
+		map->changes = NULL;
+		map->changes_size = 0;
+	}
+	pthread_mutex_unlock(&map->changes_mutex);
+}
+
+size_t map_snapshot_read(map_t *map, uint64_t seq, size_t offset, uint8_t *out, size_t len) {
+	const size_t num_blocks = map->width * map->depth * map->height;
+	if (offset >= num_blocks) {
+		return 0;
+	}
+
+	len = util_min(len, num_blocks - offset);
+	map_read_blocks(map, offset, out, len);
+
+	// Walk backwards so that the oldest change after the snapshot wins, as that holds the block as it
+	// was when the snapshot was taken.
+	pthread_mutex_lock(&map->changes_mutex);
+	for (size_t i = map->num_changes; i > 0 && map->changes_base + i - 1 >= seq; i--) {
+		const blockchange_t *change = &map->changes[i - 1];
+		if (change->index >= offset && change->index < offset + len) {
+			out[change->index - offset] = change->old_block;
+		}
+	}
+	pthread_mutex_unlock(&map->changes_mutex);
+
+	return len;
+}
+
+static int compare_indices(const void *a, const void *b) {
+	const uint32_t ia = *(const uint32_t *)a;
+	const uint32_t ib = *(const uint32_t *)b;
+	return (ia > ib) - (ia < ib);
+}
+
+// The current block is the last value written, so each position only needs sending once.
+size_t map_sort_unique_indices(uint32_t *indices, size_t count) {
+	qsort(indices, count, sizeof(*indices), compare_indices);
+
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (n == 0 || indices[n - 1] != indices[i]) {
+			indices[n++] = indices[i];
+		}
+	}
+
+	return n;
+}
+
+uint32_t *map_snapshot_changes(map_t *map, uint64_t seq, size_t *num_changes) {
+	*num_changes = 0;
+
+	if (seq < map->changes_base || seq >= map->changes_base + map->num_changes) {
+		return NULL;
+	}
+
+	const size_t first = (size_t)(seq - map->changes_base);
+	const size_t count = map->num_changes - first;
+	uint32_t *indices = malloc(sizeof(*indices) * count);
+	for (size_t i = 0; i < count; i++) {
+		indices[i] = map->changes[first + i].index;
+	}
+
+	*num_changes = map_sort_unique_indices(indices, count);
+	return indices;
+}
+
+// Returns the blocks changed since the last call, each once and in level order, and starts over. The
+// array is only valid until the next map_set().
+const uint32_t *map_take_dirty(map_t *map, size_t *num_dirty) {
+	*num_dirty = map_sort_unique_indices(map->dirty, map->num_dirty);
+	map->num_dirty = 0;
+	return map->dirty;
+}
+
+// Copies part of the level out in XZY order, whichever way it's stored.
+void map_read_blocks(map_t *map, size_t offset, uint8_t *out, size_t len) {
+	if (map->blocks != NULL) {
+		memcpy(out, map->blocks + offset, len);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&map->chunks_lock);
+
+	const size_t end = offset + len;
+	size_t index = offset;
+
+	while (index < end) {
+		size_t x, y, z;
+		map_index_to_pos(map, index, &x, &y, &z);
+
+		// The rest of this row, split at chunk edges.
+		const size_t row_end = index + util_min(map->width - x, end - index);
+		while (index < row_end) {
+			const unsigned n = (unsigned)util_min(MAPCHUNK_SIZE - (x & MAPCHUNK_MASK), row_end - index);
+			mapchunk_read(map_chunk(map, x, y, z), mapchunk_index(x, y, z), out + (index - offset), n);
+			index += n;
+			x += n;
+		}
+	}
+
+	pthread_rwlock_unlock(&map->chunks_lock);
+}
+
+// Replaces the whole level with blocks in XZY order.
+void map_load_blocks(map_t *map, const uint8_t *blocks) {
+	map_forget_columns(map);
+	free(map->random_tick_counts);
+	map->random_tick_counts = NULL;
+
+	if (map->blocks != NULL) {
+		memcpy(map->blocks, blocks, map->width * map->depth * map->height);
+		return;
+	}
+
+	uint8_t chunk_blocks[MAPCHUNK_VOLUME];
+
+	pthread_rwlock_wrlock(&map->chunks_lock);
+
+	for (size_t cy = 0; cy < map->chunks_y; cy++)
+	for (size_t cz = 0; cz < map->chunks_z; cz++)
+	for (size_t cx = 0; cx < map->chunks_x; cx++) {
+		// Chunks hanging over the edge of the level are padded with air.
+		memset(chunk_blocks, air, sizeof(chunk_blocks));
+
+		const size_t x0 = cx << MAPCHUNK_SHIFT;
+		const size_t xn = util_min(MAPCHUNK_SIZE, map->width - x0);
+
+		for (size_t y = cy << MAPCHUNK_SHIFT; y < util_min((cy + 1) << MAPCHUNK_SHIFT, map->depth); y++)
+		for (size_t z = cz << MAPCHUNK_SHIFT; z < util_min((cz + 1) << MAPCHUNK_SHIFT, map->height); z++) {
+			memcpy(chunk_blocks + mapchunk_index(x0, y, z), blocks + map_get_block_index(map, x0, y, z), xn);
+		}
+
+		mapchunk_encode(map_chunk(map, x0, cy << MAPCHUNK_SHIFT, cz << MAPCHUNK_SHIFT), chunk_blocks);
+	}
+
+	pthread_rwlock_unlock(&map->chunks_lock);
+}
+
+// Chunks only ever grow as blocks are placed, this shrinks the ones changed since the last call back
+// to the smallest form that holds what's in them now.
+void map_compact(map_t *map) {
+	if (map->chunks == NULL) {
+		return;
+	}
+
+	uint8_t chunk_blocks[MAPCHUNK_VOLUME];
+	const size_t num_chunks = map->chunks_x * map->chunks_y * map->chunks_z;
+	size_t memory = 0, uniform = 0, raw = 0;
+
+	pthread_rwlock_wrlock(&map->chunks_lock);
+
+	for (size_t i = 0; i < num_chunks; i++) {
+		mapchunk_t *chunk = &map->chunks[i];
+		if (chunk->modified && chunk->bits != 0) {
+			mapchunk_decode(chunk, chunk_blocks);
+			mapchunk_encode(chunk, chunk_blocks);
+		}
+		chunk->modified = false;
+
+		memory += mapchunk_memory(chunk);
+		uniform += chunk->bits == 0;
+		raw += chunk->bits == 8;
+	}
+
+	pthread_rwlock_unlock(&map->chunks_lock);
+
+	log_printf(log_info, "Level storage: %zu KB in %zu chunks (%zu uniform, %zu palette, %zu raw)",
+		memory / 1024, num_chunks, uniform, num_chunks - uniform - raw, raw);
 }
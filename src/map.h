@@ -18,40 +18,127 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include "mapchunk.h"
+
+// Scheduled ticks live in a timing wheel: one list per tick modulo TICKWHEEL_SIZE, plus an extra list
+// holding the slot that is being run. Ticks further ahead than the wheel wait in their slot until they
+// come around. Nodes are pooled and referred to by index, TICK_NONE ends a list.
+#define TICKWHEEL_SIZE 64
+#define TICKWHEEL_MASK (TICKWHEEL_SIZE - 1)
+#define TICK_NONE UINT32_MAX
 
 typedef struct scheduledtick_s {
-	size_t x, y, z;
+	uint32_t index;
+	uint32_t prev, next;
+	uint32_t hash_next;
+	uint32_t slot;
 	uint64_t time;
 } scheduledtick_t;
 
+typedef struct tickslot_s {
+	uint32_t head, tail;
+} tickslot_t;
+
+typedef struct blockchange_s {
+	uint32_t index;
+	uint8_t old_block;
+} blockchange_t;
+
+#define MAP_COLUMN_UNKNOWN UINT16_MAX
+
 typedef struct map_s {
 	char *name;
 
 	size_t width, depth, height;
-	uint8_t *blocks;
+	uint8_t *blocks; // flat storage, NULL when the level is stored in chunks
+
+	// The level in chunks of MAPCHUNK_SIZE cubed, whatever the storage.
+	size_t chunks_x, chunks_y, chunks_z;
+
+	// Chunked storage. Workers reading the level take chunks_lock for reading, the main thread only
+	// takes it for writing when a chunk has to change representation.
+	mapchunk_t *chunks;
+	pthread_rwlock_t chunks_lock;
+
+	// Mapped storage, blocks points into a shared mapping of the level's sidecar file.
+	void *mapping;
+	size_t mapping_size;
+	int mapping_fd;
+
+	// Per column (z * width + x), the highest block that isn't air and the highest that blocks light,
+	// as returned by map_get_top() and map_get_top_lit(). MAP_COLUMN_UNKNOWN until first asked for.
+	uint16_t *column_top;
+	uint16_t *column_top_lit;
+
+	// Per 16x16x16 chunk, how many of its blocks have a random_tickfunc. NULL until the first tick.
+	uint16_t *random_tick_counts;
 
 	bool generating;
 	bool modified;
 
+	// Pending scheduled ticks, at most one per block. tick_hash chains them by block index.
 	size_t num_ticks;
 	size_t ticks_size;
 	scheduledtick_t *ticks;
+	uint32_t free_tick;
+	tickslot_t wheel[TICKWHEEL_SIZE + 1];
+	uint64_t wheel_tick;
+	uint32_t *tick_hash;
+	unsigned tick_hash_bits;
+
+	// Changes made while level snapshots are outstanding, see map_snapshot_begin().
+	pthread_mutex_t changes_mutex;
+	uint64_t change_seq;
+	uint64_t changes_base;
+	size_t num_changes;
+	size_t changes_size;
+	blockchange_t *changes;
+	size_t num_snapshots;
+	uint64_t *snapshots;
+
+	// Blocks changed this tick that clients still have to be told about, see map_take_dirty().
+	size_t num_dirty;
+	size_t dirty_size;
+	uint32_t *dirty;
 } map_t;
 
 map_t *map_create(const char *name, size_t width, size_t depth, size_t height);
+// Like map_create(), but mapped storage keeps the blocks already in the sidecar file.
+map_t *map_reopen(const char *name, size_t width, size_t depth, size_t height);
 void map_destroy(map_t *map);
 
 void map_set(map_t *map, size_t x, size_t y, size_t z, uint8_t block);
 uint8_t map_get(map_t *map, size_t x, size_t y, size_t z);
+uint8_t map_get_index(map_t *map, size_t index);
+void map_set_index(map_t *map, size_t index, uint8_t block);
 size_t map_get_top(map_t *map, size_t x, size_t z);
 size_t map_get_top_lit(map_t *map, size_t x, size_t z);
 
 void map_tick(map_t *map);
 void map_add_tick(map_t *map, size_t x, size_t y, size_t z, uint64_t num_ticks_until);
+void map_list_ticks(map_t *map, int32_t *indices, int32_t *times);
+
+uint64_t map_snapshot_begin(map_t *map);
+void map_snapshot_retain(map_t *map, uint64_t seq);
+void map_snapshot_end(map_t *map, uint64_t seq);
+size_t map_snapshot_read(map_t *map, uint64_t seq, size_t offset, uint8_t *out, size_t len);
+uint32_t *map_snapshot_changes(map_t *map, uint64_t seq, size_t *num_changes);
+size_t map_sort_unique_indices(uint32_t *indices, size_t count);
+const uint32_t *map_take_dirty(map_t *map, size_t *num_dirty);
+
+void map_read_blocks(map_t *map, size_t offset, uint8_t *out, size_t len);
+void map_load_blocks(map_t *map, const uint8_t *blocks);
+void map_compact(map_t *map);
 
 void map_save(map_t *map);
 map_t *map_load(const char *name);
 
+bool map_sidecar_attach(map_t *map, bool keep);
+void map_sidecar_detach(map_t *map);
+void map_sidecar_save(map_t *map);
+map_t *map_sidecar_load(const char *name);
+
 static inline bool map_pos_valid(map_t *map, size_t x, size_t y, size_t z) {
 	return x < map->width && y < map->depth && z < map->height;
 }
@@ -61,8 +148,8 @@ static inline size_t map_get_block_index(map_t *map, size_t x, size_t y, size_t
 }
 
 static inline void map_index_to_pos(map_t *map, size_t index, size_t *x, size_t *y, size_t *z) {
-	*y = index / (map->width * map->depth);
-	index -= *y * map->width * map->depth;
+	*y = index / (map->width * map->height);
+	index -= *y * map->width * map->height;
 	*z = index / map->width;
 	*x = index % map->width;
 }
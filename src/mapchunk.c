@@ -0,0 +1,163 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include "mapchunk.h"
+
+void mapchunk_init(mapchunk_t *chunk, uint8_t block) {
+	chunk->bits = 0;
+	chunk->palette_size = 1;
+	chunk->palette[0] = block;
+	chunk->modified = false;
+	chunk->data = NULL;
+}
+
+void mapchunk_free(mapchunk_t *chunk) {
+	free(chunk->data);
+	chunk->data = NULL;
+}
+
+static unsigned bits_for_palette(unsigned size) {
+	if (size <= 1) {
+		return 0;
+	}
+	else if (size <= 2) {
+		return 1;
+	}
+	else if (size <= 4) {
+		return 2;
+	}
+	else if (size <= MAPCHUNK_PALETTE_SIZE) {
+		return 4;
+	}
+
+	return 8;
+}
+
+static inline void store_index(uint8_t *data, unsigned bits, unsigned index, unsigned value) {
+	const unsigned shift = (index & (8 / bits - 1)) * bits;
+	const unsigned mask = ((1U << bits) - 1) << shift;
+	uint8_t *p = &data[index * bits / 8];
+	*p = (uint8_t)((*p & ~mask) | (value << shift));
+}
+
+bool mapchunk_try_set(mapchunk_t *chunk, unsigned index, uint8_t block) {
+	chunk->modified = true;
+
+	if (chunk->bits == 8) {
+		chunk->data[index] = block;
+		return true;
+	}
+
+	unsigned p;
+	for (p = 0; p < chunk->palette_size; p++) {
+		if (chunk->palette[p] == block) {
+			break;
+		}
+	}
+
+	if (chunk->bits == 0) {
+		return p == 0;
+	}
+
+	if (p == chunk->palette_size) {
+		if (p >= (1U << chunk->bits)) {
+			return false;
+		}
+
+		// Nothing refers to the new entry until the index below is stored, so readers never see it half-made.
+		chunk->palette[chunk->palette_size++] = block;
+	}
+
+	store_index(chunk->data, chunk->bits, index, p);
+	return true;
+}
+
+void mapchunk_set_slow(mapchunk_t *chunk, unsigned index, uint8_t block) {
+	uint8_t blocks[MAPCHUNK_VOLUME];
+	mapchunk_decode(chunk, blocks);
+	blocks[index] = block;
+	mapchunk_encode(chunk, blocks);
+	chunk->modified = true;
+}
+
+// Picks the smallest representation that holds the blocks.
+void mapchunk_encode(mapchunk_t *chunk, const uint8_t *blocks) {
+	int16_t lookup[256];
+	uint8_t palette[MAPCHUNK_PALETTE_SIZE];
+	unsigned num_types = 0;
+
+	memset(lookup, -1, sizeof(lookup));
+
+	for (unsigned i = 0; i < MAPCHUNK_VOLUME && num_types <= MAPCHUNK_PALETTE_SIZE; i++) {
+		if (lookup[blocks[i]] < 0) {
+			if (num_types < MAPCHUNK_PALETTE_SIZE) {
+				palette[num_types] = blocks[i];
+			}
+			lookup[blocks[i]] = (int16_t)num_types++;
+		}
+	}
+
+	const unsigned bits = bits_for_palette(num_types);
+	uint8_t *data = NULL;
+
+	if (bits == 8) {
+		data = malloc(MAPCHUNK_VOLUME);
+		memcpy(data, blocks, MAPCHUNK_VOLUME);
+	}
+	else if (bits > 0) {
+		data = calloc(MAPCHUNK_VOLUME * bits / 8, 1);
+		for (unsigned i = 0; i < MAPCHUNK_VOLUME; i++) {
+			store_index(data, bits, i, (unsigned)lookup[blocks[i]]);
+		}
+	}
+
+	free(chunk->data);
+	chunk->data = data;
+	chunk->bits = (uint8_t)bits;
+	chunk->palette_size = (uint8_t)(bits == 8 ? 0 : num_types);
+	memcpy(chunk->palette, palette, bits == 8 ? 0 : num_types);
+}
+
+void mapchunk_decode(const mapchunk_t *chunk, uint8_t *blocks) {
+	mapchunk_read(chunk, 0, blocks, MAPCHUNK_VOLUME);
+}
+
+void mapchunk_read(const mapchunk_t *chunk, unsigned index, uint8_t *out, unsigned len) {
+	switch (chunk->bits) {
+		case 0: {
+			memset(out, chunk->palette[0], len);
+			break;
+		}
+
+		case 8: {
+			memcpy(out, chunk->data + index, len);
+			break;
+		}
+
+		default: {
+			for (unsigned i = 0; i < len; i++) {
+				out[i] = mapchunk_get(chunk, index + i);
+			}
+			break;
+		}
+	}
+}
+
+size_t mapchunk_memory(const mapchunk_t *chunk) {
+	return sizeof(*chunk) + (chunk->bits == 0 ? 0 : MAPCHUNK_VOLUME * chunk->bits / 8);
+}
@@ -0,0 +1,66 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAPCHUNK_SHIFT 4
+#define MAPCHUNK_SIZE (1 << MAPCHUNK_SHIFT)
+#define MAPCHUNK_MASK (MAPCHUNK_SIZE - 1)
+#define MAPCHUNK_VOLUME (MAPCHUNK_SIZE * MAPCHUNK_SIZE * MAPCHUNK_SIZE)
+#define MAPCHUNK_PALETTE_SIZE 16
+
+// A 16x16x16 piece of the level, blocks ordered XZY like the level itself. A chunk holding a single
+// block type stores nothing but that ID, one with up to 16 types stores 1, 2 or 4 bit palette indices,
+// anything else stores the raw block IDs.
+typedef struct mapchunk_s {
+	uint8_t bits; // 0 when uniform, 8 when raw
+	uint8_t palette_size;
+	bool modified;
+	uint8_t palette[MAPCHUNK_PALETTE_SIZE];
+	uint8_t *data;
+} mapchunk_t;
+
+static inline unsigned mapchunk_index(size_t x, size_t y, size_t z) {
+	return (unsigned)((((y & MAPCHUNK_MASK) << MAPCHUNK_SHIFT) | (z & MAPCHUNK_MASK)) << MAPCHUNK_SHIFT) | (x & MAPCHUNK_MASK);
+}
+
+static inline uint8_t mapchunk_get(const mapchunk_t *chunk, unsigned index) {
+	switch (chunk->bits) {
+		case 0: return chunk->palette[0];
+		case 8: return chunk->data[index];
+		default: {
+			const unsigned bits = chunk->bits;
+			const unsigned shift = (index & (8 / bits - 1)) * bits;
+			return chunk->palette[(chunk->data[index * bits / 8] >> shift) & ((1U << bits) - 1)];
+		}
+	}
+}
+
+void mapchunk_init(mapchunk_t *chunk, uint8_t block);
+void mapchunk_free(mapchunk_t *chunk);
+
+// Stores the block if the chunk can take it without changing representation, otherwise returns false
+// and leaves the chunk alone.
+bool mapchunk_try_set(mapchunk_t *chunk, unsigned index, uint8_t block);
+void mapchunk_set_slow(mapchunk_t *chunk, unsigned index, uint8_t block);
+
+void mapchunk_encode(mapchunk_t *chunk, const uint8_t *blocks);
+void mapchunk_decode(const mapchunk_t *chunk, uint8_t *blocks);
+void mapchunk_read(const mapchunk_t *chunk, unsigned index, uint8_t *out, unsigned len);
+size_t mapchunk_memory(const mapchunk_t *chunk);
@@ -52,6 +52,7 @@ void map_generate(map_t *map, const char *generator_name) {
 	}
 
 	map->generating = false;
+	map_compact(map);
 }
 
 void fill_oblate_spherioid(map_t *map, int centreX, int centreY, int centreZ, double radius, bool filter_stone, uint8_t block) {
@@ -93,8 +94,9 @@ void flood_fill(map_t *map, unsigned int startIndex, uint8_t block) {
 
 		if (index >= blocklen) continue;
 
-		if (map->blocks[index] != air && map->blocks[index] != magenta_wool) continue;
-		map->blocks[index] = block;
+		const uint8_t current = map_get_index(map, index);
+		if (current != air && current != magenta_wool) continue;
+		map_set_index(map, index, block);
 
 		unsigned int x = index % map->width;
 		unsigned int y = index / oneY;
@@ -46,7 +46,7 @@ void mapgen_random(map_t *map) {
 	rng_t *rng = rng_create(0);
 
 	for (size_t i = 0; i < map->width * map->depth * map->height; i++) {
-		map->blocks[i] = rng_next(rng, num_blocks);
+		map_set_index(map, i, rng_next(rng, num_blocks));
 	}
 
 	rng_destroy(rng);
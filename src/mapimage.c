@@ -1,6 +1,5 @@
 #include <stdint.h>
 #include <stdlib.h>
-#include <pthread.h>
 #include <string.h>
 #include <sys/types.h>
 #include "mapimage.h"
@@ -8,6 +7,7 @@
 #include "map.h"
 #include "blocks.h"
 #include "endian.h"
+#include "worker.h"
 
 typedef struct {
 	uint8_t *blocks;
@@ -19,7 +19,7 @@ static inline uint8_t dim(uint8_t value, double factor) {
 	return (uint8_t)((double)value * factor);
 }
 
-void *map_save_image(void *userdata) {
+static void map_save_image(void *userdata) {
 	imagethread_t *data = (imagethread_t *)userdata;
 
 	uint32_t *pixels = calloc(data->width * data->height, sizeof(uint32_t));
@@ -46,7 +46,6 @@ void *map_save_image(void *userdata) {
 	free(data->path);
 	free(data->blocks);
 	free(data);
-	return NULL;
 }
 
 void map_save_image_threaded(map_t *map, const char *path) {
@@ -61,11 +60,7 @@ void map_save_image_threaded(map_t *map, const char *path) {
 	data->blocks = malloc(data->width * data->height * data->depth);
 	data->path = strdup(path);
 
-	memcpy(data->blocks, map->blocks, data->width * data->height * data->depth);
+	map_read_blocks(map, 0, data->blocks, data->width * data->height * data->depth);
 
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-
-	pthread_t thread;
-	pthread_create(&thread, &attr, map_save_image, data);
+	worker_submit(jobpriority_low, map_save_image, NULL, data);
 }
\ No newline at end of file
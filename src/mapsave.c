@@ -24,8 +24,11 @@
 #include "server.h"
 #include "log.h"
 #include "config.h"
+#include "util.h"
 
 void map_save(map_t *map) {
+	map_compact(map);
+
 	if (!map->modified) {
 		return;
 	}
@@ -34,6 +37,14 @@ void map_save(map_t *map) {
 		return;
 	}
 
+	if (map->mapping != NULL) {
+		log_printf(log_info, "Saving map to '%s.blocks'", map->name);
+		map_sidecar_save(map);
+		map->modified = false;
+		log_printf(log_info, "Saved!");
+		return;
+	}
+
 	char filename[256];
 	snprintf(filename, sizeof(filename), "%s.cw", map->name);
 
@@ -50,7 +61,9 @@ void map_save(map_t *map) {
 	tag_t *x_size = nbt_create("X"); nbt_set_int16(x_size, (int16_t)map->width);
 	tag_t *y_size = nbt_create("Y"); nbt_set_int16(y_size, (int16_t)map->depth);
 	tag_t *z_size = nbt_create("Z"); nbt_set_int16(z_size, (int16_t)map->height);
-	tag_t *block_array = nbt_copy_bytearray("BlockArray", map->blocks, num_blocks);
+	uint8_t *blocks = malloc(num_blocks);
+	map_read_blocks(map, 0, blocks, num_blocks);
+	tag_t *block_array = nbt_create_bytearray("BlockArray", blocks, num_blocks);
 	tag_t *metadata = nbt_create_compound("Metadata");
 	tag_t *software_data = nbt_create_compound("Thirty");
 
@@ -60,12 +73,7 @@ void map_save(map_t *map) {
 	int32_t *tick_times_data = calloc(map->num_ticks, sizeof(int32_t));
 	tag_t *tick_times = nbt_create_intarray("Times", tick_times_data, (int32_t)map->num_ticks);
 
-	for (size_t i = 0; i < map->num_ticks; i++) {
-		const scheduledtick_t *tick = &map->ticks[i];
-
-		tick_indices_data[i] = (int32_t)map_get_block_index(map, tick->x, tick->y, tick->z);
-		tick_times_data[i] = (int32_t)(tick->time - server.tick);
-	}
+	map_list_ticks(map, tick_indices_data, tick_times_data);
 
 	nbt_add_tag(scheduled_ticks, tick_indices);
 	nbt_add_tag(scheduled_ticks, tick_times);
@@ -85,12 +93,10 @@ void map_save(map_t *map) {
 
 	// Now write it out and gzip it.
 
-	buffer_t *outbuf = buffer_allocate_memory(num_blocks, true);
+	// The block array is referenced rather than copied, zlib reads it straight from the tag.
+	buffer_t *outbuf = buffer_create_chain();
 	nbt_write(root, outbuf);
-	buffer_seek(outbuf, 0);
 
-	size_t readbufsize = 2 * 1024 * 1024;
-	uint8_t *readbuf = malloc(readbufsize);
 	size_t gzbufsize = 2 * 1024 * 1024;
 	uint8_t *gzbuf = malloc(gzbufsize);
 	FILE *fp = fopen(filename, "wb");
@@ -100,6 +106,7 @@ void map_save(map_t *map) {
 	strm.zfree = Z_NULL;
 	strm.opaque = Z_NULL;
 
+	// Saves run on the main thread and hold up the tick, so they favour speed over size.
 	int err = deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
 	if (err != Z_OK) {
 		log_printf(log_error, "Failed to init zlib stream.");
@@ -109,9 +116,10 @@ void map_save(map_t *map) {
 	unsigned int have;
 	int flush;
 	do {
-		strm.avail_in = buffer_read(outbuf, readbuf, readbufsize);
-		flush = (buffer_tell(outbuf) == buffer_size(outbuf)) ? Z_FINISH : Z_NO_FLUSH;
-		strm.next_in = readbuf;
+		size_t len;
+		strm.next_in = (uint8_t *)buffer_chain_next(outbuf, &len);
+		strm.avail_in = (unsigned int)len;
+		flush = buffer_tell(outbuf) == 0 ? Z_FINISH : Z_NO_FLUSH;
 
 		do {
 			strm.avail_out = gzbufsize;
@@ -137,7 +145,6 @@ cleanup:
 
 	fclose(fp);
 	free(gzbuf);
-	free(readbuf);
 	buffer_destroy(outbuf);
 
 	nbt_destroy(root, true);
@@ -147,7 +154,11 @@ map_t *map_load(const char *name) {
 	char filename[256];
 	snprintf(filename, sizeof(filename), "%s.cw", name);
 
-	map_t *map = NULL;
+	map_t *map = map_sidecar_load(name);
+	if (map != NULL) {
+		return map;
+	}
+
 	uint8_t *inbuf = NULL, *outbuf = NULL;
 	tag_t *root = NULL;
 	buffer_t *nbtbuf = NULL;
@@ -173,7 +184,20 @@ map_t *map_load(const char *name) {
 		goto cleanup;
 	}
 
-	nbtbuf = buffer_allocate_memory(0, true);
+	// gzip ends with the uncompressed size, modulo 4 GiB. It's only a hint, the buffer still grows if
+	// it's wrong. Deflate can't shrink anything more than 1032 to 1, a bigger size is a corrupt file.
+	uint8_t trailer[4] = { 0 };
+	size_t compressed_size = 0;
+	if (fseek(fp, -4, SEEK_END) == 0) {
+		compressed_size = (size_t)ftell(fp) + sizeof(trailer);
+		if (fread(trailer, 1, sizeof(trailer), fp) != sizeof(trailer)) {
+			memset(trailer, 0, sizeof(trailer));
+		}
+	}
+	fseek(fp, 0, SEEK_SET);
+
+	const size_t size_hint = (size_t)trailer[0] | (size_t)trailer[1] << 8 | (size_t)trailer[2] << 16 | (size_t)trailer[3] << 24;
+	nbtbuf = buffer_allocate_growable(util_min(size_hint, compressed_size * 1032));
 
 	do {
 		strm.avail_in = fread(inbuf, 1, inbufsize, fp);
@@ -195,7 +219,11 @@ map_t *map_load(const char *name) {
 			ret = inflate(&strm, Z_NO_FLUSH);
 
 			unsigned have = outbufsize - strm.avail_out;
-			buffer_write(nbtbuf, outbuf, have);
+			if (buffer_write(nbtbuf, outbuf, have) != have) {
+				log_printf(log_error, "Out of memory loading '%s'", filename);
+				inflateEnd(&strm);
+				goto cleanup;
+			}
 		} while (strm.avail_out == 0);
 	} while (ret != Z_STREAM_END);
 
@@ -238,7 +266,7 @@ map_t *map_load(const char *name) {
 	d = (size_t)ysize->s;
 	h = (size_t)zsize->s;
 	map = map_create(name, w, d, h);
-	memcpy(map->blocks, blocks->pb, w * d * h);
+	map_load_blocks(map, blocks->pb);
 
 	{
 		tag_t *metadata = nbt_get_tag(root, "Metadata");
@@ -264,7 +292,8 @@ map_t *map_load(const char *name) {
 		}
 	}
 
-	map->modified = false;
+	// A freshly created sidecar still has to get the scheduled ticks on the next save.
+	map->modified = map->mapping != NULL;
 
 cleanup:
 	nbt_destroy(root, true);
@@ -14,9 +14,9 @@
 // You should have received a copy of the GNU Affero General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
-#include <pthread.h>
 #include <zlib.h>
 #include <stdlib.h>
+#include <string.h>
 #include "buffer.h"
 #include "map.h"
 #include "client.h"
@@ -25,97 +25,298 @@
 #include "blocks.h"
 #include "util.h"
 #include "log.h"
+#include "config.h"
+#include "voxdeflate.h"
 
-void *mapsend_thread_start(void *data) {
-	mapsend_t *info = (mapsend_t *)data;
-	const uint32_t num_blocks = info->width * info->height * info->depth;
+#define INBUFSIZE (2 * 1024 * 1024)
 
-	if (!client_supports_extension(info->client, "CustomBlocks", 1)) {
-		for (size_t i = 0; i < num_blocks; i++) {
-			if (info->client->protocol_version <= 4 && info->data[i] > leaves) {
-				info->data[i] = air;
-			}
-			if (info->client->protocol_version <= 5 && info->data[i] > glass) {
-				info->data[i] = air;
-			}
-			else if (info->client->protocol_version <= 6 && info->data[i] > gold_block) {
-				info->data[i] = air;
-			}
-			else {
-				info->data[i] = block_get_fallback(info->data[i]);
-			}
+// zlib's own estimate for windowBits 15 and memLevel 8.
+#define DEFLATE_STATE_SIZE ((1 << 17) + (1 << 17))
+
+// Links slower than this get the smallest payload regardless of load.
+#define SLOW_LINK_RATE (128 * 1024)
+
+// A cached level image stops being reused once this many changes would have to be replayed on top.
+#define LEVELCACHE_MAX_CHANGES 4096
+
+static int mapsend_pressure = 0;
+static levelcache_t *level_cache = NULL;
+
+static bool mapsend_use_voxel(void) {
+	return strcmp(config.server.level_encoder, "voxel") == 0;
+}
+
+static void convert_blocks(client_t *client, uint8_t *data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (client->protocol_version <= 4 && data[i] > leaves) {
+			data[i] = air;
+		}
+		if (client->protocol_version <= 5 && data[i] > glass) {
+			data[i] = air;
+		}
+		else if (client->protocol_version <= 6 && data[i] > gold_block) {
+			data[i] = air;
+		}
+		else {
+			data[i] = block_get_fallback(data[i]);
 		}
 	}
+}
 
-	int outsize = ((num_blocks + sizeof(uint32_t)) * 1.1) + 12;
-	uint8_t *outbuf = malloc(outsize);
+static buffer_t *compress_zlib(client_t *client, bool convert) {
+	const uint32_t num_blocks = server.map->width * server.map->height * server.map->depth;
+
+	const size_t inbufsize = util_min(INBUFSIZE, num_blocks);
+	uint8_t *inbuf = malloc(inbufsize);
+	uint8_t *outbuf = NULL;
+	buffer_t *result = NULL;
 
 	z_stream stream;
 	stream.zalloc = Z_NULL;
 	stream.zfree = Z_NULL;
 	stream.opaque = Z_NULL;
-	stream.avail_in = num_blocks + sizeof(uint32_t);
-	stream.next_in = (Bytef *)info->data;
-	stream.avail_out = outsize;
-	stream.next_out = (Bytef *)outbuf;
 
-	int err = deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+	int err = deflateInit2(&stream, client->mapsend_level, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
 	if (err != Z_OK) {
-		info->client->mapsend_state = mapsend_failure;
 		log_printf(log_error, "Failed to init zlib stream.");
 		goto cleanup;
 	}
 
-	while ((deflate(&stream, Z_FINISH)) != Z_STREAM_END);
+	size_t outsize = deflateBound(&stream, num_blocks + sizeof(uint32_t));
+	outbuf = malloc(outsize);
+	stream.avail_out = outsize;
+	stream.next_out = (Bytef *)outbuf;
+
+	uint8_t header[sizeof(uint32_t)];
+	buffer_t *headerbuf = buffer_create_memory(header, sizeof(header));
+	buffer_write_uint32be(headerbuf, num_blocks);
+	buffer_destroy(headerbuf);
+
+	stream.avail_in = sizeof(header);
+	stream.next_in = header;
+	deflate(&stream, Z_NO_FLUSH);
+
+	size_t offset = 0;
+	while (offset < num_blocks) {
+		size_t len = map_snapshot_read(server.map, client->snapshot_seq, offset, inbuf, inbufsize);
+		offset += len;
+
+		if (convert) {
+			convert_blocks(client, inbuf, len);
+		}
+
+		const int flush = offset == num_blocks ? Z_FINISH : Z_NO_FLUSH;
+		stream.avail_in = len;
+		stream.next_in = inbuf;
+
+		err = deflate(&stream, flush);
+		if (err == Z_STREAM_ERROR || (flush == Z_FINISH && err != Z_STREAM_END)) {
+			log_printf(log_error, "Failed to compress data.");
+			deflateEnd(&stream);
+			goto cleanup;
+		}
+
+		if (!client->connected) {
+			deflateEnd(&stream);
+			goto cleanup;
+		}
+	}
+
 	deflateEnd(&stream);
 
 	outsize = stream.total_out;
 
-	info->client->mapgz_buffer = buffer_allocate_memory(outsize, false);
-	buffer_write(info->client->mapgz_buffer, outbuf, outsize);
-	buffer_seek(info->client->mapgz_buffer, 0);
-
-	info->client->mapsend_state = mapsend_success;
+	result = buffer_allocate_memory(outsize, false);
+	buffer_write(result, outbuf, outsize);
+	buffer_seek(result, 0);
 
 cleanup:
 	free(outbuf);
-	free(info->data);
-	free(info);
+	free(inbuf);
 
-	pthread_exit(NULL);
-	return NULL;
+	return result;
 }
 
-#define OUTBUFSIZE 1024
+static buffer_t *compress_voxel(client_t *client, bool convert) {
+	const uint32_t num_blocks = server.map->width * server.map->height * server.map->depth;
+
+	const size_t inbufsize = util_min(INBUFSIZE, num_blocks);
+	uint8_t *inbuf = malloc(inbufsize);
+	buffer_t *result = buffer_allocate_memory(0, true);
+
+	voxdeflate_t *vd = voxdeflate_create(server.map->width, server.map->width * server.map->height, true);
+	const uint8_t *out;
+	size_t outlen;
+
+	uint8_t header[sizeof(uint32_t)];
+	buffer_t *headerbuf = buffer_create_memory(header, sizeof(header));
+	buffer_write_uint32be(headerbuf, num_blocks);
+	buffer_destroy(headerbuf);
+
+	outlen = voxdeflate_compress(vd, header, sizeof(header), false, &out);
+	buffer_write(result, out, outlen);
+
+	size_t offset = 0;
+	while (offset < num_blocks) {
+		size_t len = map_snapshot_read(server.map, client->snapshot_seq, offset, inbuf, inbufsize);
+		offset += len;
 
-void *mapsend_fast_thread_start(void *data) {
+		if (convert) {
+			convert_blocks(client, inbuf, len);
+		}
+
+		outlen = voxdeflate_compress(vd, inbuf, len, offset == num_blocks, &out);
+		buffer_write(result, out, outlen);
+
+		if (!client->connected) {
+			buffer_destroy(result);
+			result = NULL;
+			break;
+		}
+	}
+
+	if (result != NULL) {
+		buffer_seek(result, 0);
+	}
+
+	voxdeflate_destroy(vd);
+	free(inbuf);
+
+	return result;
+}
+
+void mapsend_job(void *data) {
 	client_t *client = (client_t *)data;
+	const bool convert = !client_supports_extension(client, cpeext_custom_blocks);
+
+	client->mapgz_buffer = mapsend_use_voxel() ? compress_voxel(client, convert) : compress_zlib(client, convert);
+	client->mapsend_ok = client->mapgz_buffer != NULL;
+}
+
+#define OUTBUFSIZE 1024
+#define PACKETBUFSIZE (32 * 1024)
+
+// Fast transfers are compressed in windows of this size, the level can change between windows.
+#define FAST_WINDOW (512 * 1024)
+
+typedef struct {
+	client_t *client;
+	buffer_t *packetbuffer;
+	buffer_t *image;
+	size_t bytes_sent;
+	double start;
+	double wait_time;
+	int level;
+} faststream_t;
+
+// Waits until the socket has taken everything, keeping track of how long that took.
+static bool fast_flush(faststream_t *stream) {
+	const double start = get_time_s();
+	stream->bytes_sent += buffer_tell(stream->packetbuffer);
+
+	while (!client_flush_buffer(stream->client, stream->packetbuffer)) {
+		if (!stream->client->connected) {
+			return false;
+		}
+
+		usleep(1000);
+	}
+
+	stream->wait_time += get_time_s() - start;
+	return stream->client->connected;
+}
+
+static bool fast_write_chunk(faststream_t *stream, const uint8_t *data, size_t len) {
+	if (buffer_tell(stream->packetbuffer) + 1028 >= buffer_size(stream->packetbuffer)) {
+		if (!fast_flush(stream)) {
+			return false;
+		}
+	}
+
+	uint8_t chunk[OUTBUFSIZE];
+	memset(chunk, 0, sizeof(chunk));
+	memcpy(chunk, data, len);
+
+	packet_write_level_chunk(stream->packetbuffer, (uint16_t)len, chunk, 0);
+
+	if (stream->image != NULL) {
+		buffer_write(stream->image, data, len);
+	}
+
+	return true;
+}
+
+static bool fast_write_data(faststream_t *stream, const uint8_t *data, size_t len) {
+	for (size_t offset = 0; offset < len; offset += OUTBUFSIZE) {
+		if (!fast_write_chunk(stream, data + offset, util_min(OUTBUFSIZE, len - offset))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool fast_send_cached(faststream_t *stream, buffer_t *image) {
+	return fast_write_data(stream, image->mem.data, buffer_size(image)) && fast_flush(stream);
+}
+
+static bool fast_send_voxel(faststream_t *stream) {
+	client_t *client = stream->client;
 	const uint32_t num_blocks = server.map->width * server.map->height * server.map->depth;
 
-	buffer_t *blockbuffer = buffer_create_memory(server.map->blocks, num_blocks);
-	const size_t inbufsize = util_min(2 * 1024 * 1024, num_blocks);
+	const size_t inbufsize = util_min(FAST_WINDOW, num_blocks);
+	uint8_t *inbuf = malloc(inbufsize);
+
+	voxdeflate_t *vd = voxdeflate_create(server.map->width, server.map->width * server.map->height, false);
+	bool ok = true;
+
+	size_t offset = 0;
+	while (ok && offset < num_blocks) {
+		size_t len = map_snapshot_read(server.map, client->snapshot_seq, offset, inbuf, inbufsize);
+		offset += len;
+
+		const uint8_t *out;
+		size_t outlen = voxdeflate_compress(vd, inbuf, len, offset == num_blocks, &out);
+		ok = fast_write_data(stream, out, outlen);
+	}
+
+	voxdeflate_destroy(vd);
+	free(inbuf);
+
+	return ok && fast_flush(stream);
+}
+
+static bool fast_send_compressed(faststream_t *stream, int level) {
+	client_t *client = stream->client;
+	const uint32_t num_blocks = server.map->width * server.map->height * server.map->depth;
+
+	const size_t inbufsize = util_min(FAST_WINDOW, num_blocks);
+	size_t offset = 0;
+	bool ok = false;
 
 	uint8_t *inbuf = malloc(inbufsize);
 	uint8_t outbuf[OUTBUFSIZE];
 
-	buffer_t *packetbuffer = buffer_allocate_memory(32 * 1024, false);
-
 	z_stream strm;
 	strm.zalloc = Z_NULL;
 	strm.zfree = Z_NULL;
 	strm.opaque = Z_NULL;
 
-	int err = deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	int err = deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
 	if (err != Z_OK) {
-		client->mapsend_state = mapsend_failure;
 		log_printf(log_error, "Failed to init zlib stream.");
-		goto cleanup;
+		free(inbuf);
+		return false;
 	}
 
 	int flush, have;
 	do {
-		strm.avail_in = buffer_read(blockbuffer, inbuf, inbufsize);
-		flush = (buffer_tell(blockbuffer) == buffer_size(blockbuffer)) ? Z_FINISH : Z_SYNC_FLUSH;
+		const double window_start = get_time_s();
+		const double window_wait = stream->wait_time;
+
+		strm.avail_in = map_snapshot_read(server.map, client->snapshot_seq, offset, inbuf, inbufsize);
+		offset += strm.avail_in;
+		flush = (offset == num_blocks) ? Z_FINISH : Z_SYNC_FLUSH;
 		strm.next_in = inbuf;
 
 		do {
@@ -124,39 +325,337 @@ void *mapsend_fast_thread_start(void *data) {
 
 			err = deflate(&strm, flush);
 			if (err == Z_STREAM_ERROR) {
-				client->mapsend_state = mapsend_failure;
 				log_printf(log_error, "Failed to compress data.");
 				goto cleanup;
 			}
 
 			have = OUTBUFSIZE - strm.avail_out;
 
-			if (!client->connected) {
+			if (!fast_write_chunk(stream, outbuf, have)) {
 				goto cleanup;
 			}
+		} while (strm.avail_out == 0);
+
+		if (flush == Z_FINISH) {
+			break;
+		}
+
+		const double wait = stream->wait_time - window_wait;
+		const double now = get_time_s();
+		const double work = now - window_start - wait;
+		const double rate = (double)stream->bytes_sent / util_max(now - stream->start, 0.001);
+		const int next = mapsend_adapt_level(level, client->mapsend_max_level, rate, work, wait);
+
+		if (next != level) {
+			strm.avail_out = OUTBUFSIZE;
+			strm.next_out = outbuf;
+			deflateParams(&strm, next, Z_DEFAULT_STRATEGY);
 
-			if (buffer_tell(packetbuffer) + 1028 >= buffer_size(packetbuffer)) {
-				client_flush_buffer(client, packetbuffer);
-				usleep(1000000 / 20);
+			have = OUTBUFSIZE - strm.avail_out;
+			if (have > 0 && !fast_write_chunk(stream, outbuf, have)) {
+				goto cleanup;
 			}
 
-			buffer_write_uint8(packetbuffer, packet_level_chunk);
-			buffer_write_uint16be(packetbuffer, have);
-			buffer_write(packetbuffer, outbuf, 1024);
-			buffer_write_uint8(packetbuffer, 0);
-		} while (strm.avail_out == 0);
-	} while (flush != Z_FINISH);
+			// Only a stream compressed at the highest level throughout is worth caching.
+			if (next != Z_BEST_COMPRESSION) {
+				buffer_destroy(stream->image);
+				stream->image = NULL;
+			}
 
-	deflateEnd(&strm);
-	client_flush_buffer(client, packetbuffer);
+			level = next;
+		}
+	} while (true);
 
-	client->mapsend_state = mapsend_success;
+	stream->level = level;
+
+	ok = fast_flush(stream);
 
 cleanup:
+	deflateEnd(&strm);
 	free(inbuf);
-	buffer_destroy(packetbuffer);
-	buffer_destroy(blockbuffer);
 
-	pthread_exit(NULL);
-	return NULL;
+	return ok;
+}
+
+void mapsend_fast_job(void *data) {
+	client_t *client = (client_t *)data;
+
+	faststream_t stream;
+	stream.client = client;
+	stream.packetbuffer = buffer_allocate_memory(PACKETBUFSIZE, false);
+	stream.image = NULL;
+	stream.bytes_sent = 0;
+	stream.start = get_time_s();
+	stream.wait_time = 0.0;
+	stream.level = client->mapsend_level;
+
+	// The voxel encoder has no levels to trade off, so its output is always worth caching.
+	const bool voxel = mapsend_use_voxel();
+
+	bool ok;
+	if (client->level_cache != NULL) {
+		ok = fast_send_cached(&stream, client->level_cache->image);
+	}
+	else if (voxel) {
+		stream.image = buffer_allocate_memory(0, true);
+		ok = fast_send_voxel(&stream);
+	}
+	else {
+		if (client->mapsend_level == Z_BEST_COMPRESSION) {
+			stream.image = buffer_allocate_memory(0, true);
+		}
+
+		ok = fast_send_compressed(&stream, client->mapsend_level);
+	}
+
+	const double elapsed = get_time_s() - stream.start;
+
+	if (ok) {
+		if (client->level_cache != NULL) {
+			log_printf(log_info, "Sent cached level to %s: %zu bytes in %.2f s", client->name, stream.bytes_sent, elapsed);
+		}
+		else if (voxel) {
+			log_printf(log_info, "Sent level to %s: %zu bytes in %.2f s, voxel encoder", client->name, stream.bytes_sent, elapsed);
+		}
+		else {
+			log_printf(log_info, "Sent level to %s: %zu bytes in %.2f s, ending at level %d", client->name, stream.bytes_sent, elapsed, stream.level);
+		}
+
+		client->level_image = stream.image;
+	}
+	else {
+		buffer_destroy(stream.image);
+	}
+
+	client->mapsend_ok = ok;
+	buffer_destroy(stream.packetbuffer);
+}
+
+size_t mapsend_memory_estimate(bool fastmap) {
+	const size_t num_blocks = server.map->width * server.map->height * server.map->depth;
+	const size_t inbufsize = util_min(INBUFSIZE, num_blocks);
+
+	if (fastmap) {
+		return util_min(FAST_WINDOW, num_blocks) + DEFLATE_STATE_SIZE + PACKETBUFSIZE;
+	}
+
+	// The compressed level is held twice at the end, and can be slightly bigger than the input.
+	const size_t outsize = num_blocks + num_blocks / 1000 + 64;
+	return inbufsize + DEFLATE_STATE_SIZE + 2 * outsize;
+}
+
+// Called once per tick with the number of queued and running transfers. Pressure goes from 0 (idle) to
+// 2 (the tick is nearly overrunning or the join queue is long), and lowers the compression level.
+void mapsend_update_pressure(size_t pending) {
+	const double load = server.tick_time * config.server.tick_rate;
+	const size_t limit = config.server.max_level_transfers;
+
+	int pressure = 0;
+	if (load > 0.5 || pending > limit) {
+		pressure++;
+	}
+	if (load > 0.8 || pending > limit * 2) {
+		pressure++;
+	}
+
+	mapsend_pressure = pressure;
+}
+
+static int mapsend_max_level(void) {
+	return Z_BEST_COMPRESSION - 3 * mapsend_pressure;
+}
+
+static bool client_is_local(client_t *client) {
+	// The proxy is often on the same machine or network, the player usually isn't.
+	if (client->proxied) {
+		return false;
+	}
+
+	const uint8_t *ip = client->address;
+	return ip[0] == 127 || ip[0] == 10 || (ip[0] == 172 && (ip[1] & 0xF0) == 16) || (ip[0] == 192 && ip[1] == 168);
+}
+
+// Decides how a client's level will be sent: from the cached image if there is one, otherwise
+// compressed at a level that suits the current load. Also takes the client's level snapshot.
+// The load is only read here on the main thread, the transfer keeps to the highest level allowed now.
+void mapsend_plan(client_t *client, bool fastmap) {
+	mapsend_cache_expire();
+
+	client->mapsend_max_level = mapsend_max_level();
+
+	// The cache holds a FastMap stream, which other clients can't use as-is.
+	if (fastmap && level_cache != NULL) {
+		level_cache->refs++;
+		client->level_cache = level_cache;
+		client->mapsend_level = Z_BEST_COMPRESSION;
+		client->snapshot_seq = level_cache->seq;
+		map_snapshot_retain(server.map, client->snapshot_seq);
+		client->has_snapshot = true;
+		return;
+	}
+
+	client->mapsend_level = client_is_local(client) ? Z_BEST_SPEED : client->mapsend_max_level;
+	client->snapshot_seq = map_snapshot_begin(server.map);
+	client->has_snapshot = true;
+}
+
+// Called between windows of a fast transfer, with the rate the transfer has reached so far. If the
+// socket is what the transfer waits on, there's time to spare for compressing harder; if the
+// compressor is, the level drops.
+int mapsend_adapt_level(int level, int max_level, double rate, double work, double wait) {
+	if (wait > work) {
+		if (rate < SLOW_LINK_RATE) {
+			return Z_BEST_COMPRESSION;
+		}
+
+		return util_min(level + 2, max_level);
+	}
+
+	if (wait < work / 4) {
+		return util_max(level - 2, Z_BEST_SPEED);
+	}
+
+	return util_min(level, max_level);
+}
+
+void mapsend_cache_store(uint64_t seq, buffer_t *image) {
+	if (level_cache != NULL && level_cache->seq >= seq) {
+		buffer_destroy(image);
+		return;
+	}
+
+	mapsend_cache_drop();
+
+	buffer_resize(image, buffer_tell(image));
+
+	level_cache = malloc(sizeof(*level_cache));
+	level_cache->seq = seq;
+	level_cache->refs = 0;
+	level_cache->image = image;
+	map_snapshot_retain(server.map, seq);
+}
+
+void mapsend_cache_release(levelcache_t *cache) {
+	if (--cache->refs == 0 && cache != level_cache) {
+		buffer_destroy(cache->image);
+		free(cache);
+	}
+}
+
+void mapsend_cache_drop(void) {
+	if (level_cache == NULL) {
+		return;
+	}
+
+	map_snapshot_end(server.map, level_cache->seq);
+
+	// Transfers still reading the image free it when they're done.
+	if (level_cache->refs == 0) {
+		buffer_destroy(level_cache->image);
+		free(level_cache);
+	}
+
+	level_cache = NULL;
+}
+
+void mapsend_cache_expire(void) {
+	if (level_cache != NULL && server.map->change_seq - level_cache->seq > LEVELCACHE_MAX_CHANGES) {
+		mapsend_cache_drop();
+	}
+}
+
+static size_t benchmark_zlib(const uint8_t *blocks, size_t num_blocks, int level) {
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+
+	if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return 0;
+	}
+
+	const size_t outsize = deflateBound(&strm, num_blocks);
+	uint8_t *out = malloc(outsize);
+
+	strm.next_in = (Bytef *)blocks;
+	strm.avail_in = num_blocks;
+	strm.next_out = out;
+	strm.avail_out = outsize;
+
+	deflate(&strm, Z_FINISH);
+	const size_t size = strm.total_out;
+
+	deflateEnd(&strm);
+	free(out);
+
+	return size;
+}
+
+static bool benchmark_verify(const uint8_t *data, size_t len, const uint8_t *blocks, size_t num_blocks) {
+	z_stream strm;
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.next_in = Z_NULL;
+	strm.avail_in = 0;
+
+	if (inflateInit2(&strm, -15) != Z_OK) {
+		return false;
+	}
+
+	uint8_t *out = malloc(num_blocks + 1);
+
+	strm.next_in = (Bytef *)data;
+	strm.avail_in = len;
+	strm.next_out = out;
+	strm.avail_out = num_blocks + 1;
+
+	const int err = inflate(&strm, Z_FINISH);
+	const bool ok = err == Z_STREAM_END && strm.total_out == num_blocks && memcmp(out, blocks, num_blocks) == 0;
+
+	inflateEnd(&strm);
+	free(out);
+
+	return ok;
+}
+
+// Compresses the map with zlib at a few levels and with the voxel encoder, the same way a FastMap
+// transfer would, and checks the voxel stream inflates back to the original.
+void mapsend_benchmark(map_t *map) {
+	const size_t num_blocks = map->width * map->height * map->depth;
+	uint8_t *blocks = malloc(num_blocks);
+	map_read_blocks(map, 0, blocks, num_blocks);
+
+	log_printf(log_info, "Benchmarking level compression on %zux%zux%zu (%zu bytes)", map->width, map->depth, map->height, num_blocks);
+
+	static const int levels[] = { Z_BEST_SPEED, Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION };
+	for (size_t i = 0; i < sizeof(levels) / sizeof(*levels); i++) {
+		const double start = get_time_s();
+		const size_t size = benchmark_zlib(blocks, num_blocks, levels[i]);
+		const double elapsed = get_time_s() - start;
+
+		log_printf(log_info, "zlib level %2d: %9zu bytes in %8.2f ms", levels[i] == Z_DEFAULT_COMPRESSION ? 6 : levels[i], size, elapsed * 1000.0);
+	}
+
+	const double start = get_time_s();
+
+	voxdeflate_t *vd = voxdeflate_create(map->width, map->width * map->height, false);
+	buffer_t *result = buffer_allocate_memory(0, true);
+
+	for (size_t offset = 0; offset < num_blocks; offset += FAST_WINDOW) {
+		const size_t len = util_min(FAST_WINDOW, num_blocks - offset);
+
+		const uint8_t *out;
+		const size_t outlen = voxdeflate_compress(vd, blocks + offset, len, offset + len == num_blocks, &out);
+		buffer_write(result, out, outlen);
+	}
+
+	const double elapsed = get_time_s() - start;
+	const bool ok = benchmark_verify(result->mem.data, buffer_tell(result), blocks, num_blocks);
+
+	log_printf(ok ? log_info : log_error, "voxel:         %9zu bytes in %8.2f ms (%s)", buffer_tell(result), elapsed * 1000.0, ok ? "verified" : "MISMATCH");
+
+	buffer_destroy(result);
+	voxdeflate_destroy(vd);
+	free(blocks);
 }
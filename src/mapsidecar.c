@@ -0,0 +1,231 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#include "map.h"
+#include "server.h"
+#include "config.h"
+#include "log.h"
+
+// The sidecar is <name>.blocks: this header, the raw XZY block array, then the scheduled ticks as pairs
+// of int32 block index and ticks remaining. Everything is in native byte order, the file is a cache for
+// this machine rather than something to pass around; the .cw file is still the portable format.
+#define SIDECAR_MAGIC "THIRTYMB"
+#define SIDECAR_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t width, depth, height;
+	uint32_t num_ticks;
+	uint8_t reserved[36];
+} sidecarheader_t;
+
+static void sidecar_path(const char *name, char *out, size_t size) {
+	snprintf(out, size, "%s.blocks", name);
+}
+
+static bool file_newer(const struct stat *a, const struct stat *b) {
+#ifdef _WIN32
+	return a->st_mtime > b->st_mtime;
+#else
+	return a->st_mtim.tv_sec > b->st_mtim.tv_sec || (a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec > b->st_mtim.tv_nsec);
+#endif
+}
+
+// Maps the sidecar as the level's block array. Unless keep is set the file starts out empty (all air).
+bool map_sidecar_attach(map_t *map, bool keep) {
+#ifdef _WIN32
+	(void)map;
+	(void)keep;
+	log_printf(log_error, "Mapped level storage isn't supported on Windows");
+	return false;
+#else
+	char path[256];
+	sidecar_path(map->name, path, sizeof(path));
+
+	int fd = open(path, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+	if (fd < 0) {
+		log_printf(log_error, "Failed to open '%s': %s", path, strerror(errno));
+		return false;
+	}
+
+	const size_t size = sizeof(sidecarheader_t) + map->width * map->depth * map->height;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+		log_printf(log_error, "Failed to size '%s': %s", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		log_printf(log_error, "Failed to map '%s': %s", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(mapping, size, MADV_HUGEPAGE);
+#endif
+
+	if (!keep) {
+		sidecarheader_t *header = mapping;
+		memcpy(header->magic, SIDECAR_MAGIC, sizeof(header->magic));
+		header->version = SIDECAR_VERSION;
+		header->width = (uint32_t)map->width;
+		header->depth = (uint32_t)map->depth;
+		header->height = (uint32_t)map->height;
+		header->num_ticks = 0;
+	}
+
+	map->mapping = mapping;
+	map->mapping_size = size;
+	map->mapping_fd = fd;
+	map->blocks = (uint8_t *)mapping + sizeof(sidecarheader_t);
+
+	return true;
+#endif
+}
+
+void map_sidecar_detach(map_t *map) {
+#ifndef _WIN32
+	munmap(map->mapping, map->mapping_size);
+	close(map->mapping_fd);
+#endif
+
+	map->mapping = NULL;
+	map->blocks = NULL;
+}
+
+// The blocks are already in the file, saving only has to write the ticks and wait for the kernel.
+void map_sidecar_save(map_t *map) {
+#ifndef _WIN32
+	int32_t *ticks = malloc(sizeof(*ticks) * 4 * map->num_ticks);
+	int32_t *indices = ticks + 2 * map->num_ticks, *times = ticks + 3 * map->num_ticks;
+	map_list_ticks(map, indices, times);
+	for (size_t i = 0; i < map->num_ticks; i++) {
+		ticks[i * 2] = indices[i];
+		ticks[i * 2 + 1] = times[i];
+	}
+
+	const size_t ticks_size = sizeof(*ticks) * 2 * map->num_ticks;
+	if (pwrite(map->mapping_fd, ticks, ticks_size, map->mapping_size) != (ssize_t)ticks_size ||
+		ftruncate(map->mapping_fd, map->mapping_size + ticks_size) != 0) {
+		log_printf(log_error, "Failed to write scheduled ticks for '%s': %s", map->name, strerror(errno));
+	}
+
+	free(ticks);
+
+	sidecarheader_t *header = map->mapping;
+	header->num_ticks = (uint32_t)map->num_ticks;
+
+	if (msync(map->mapping, map->mapping_size, MS_SYNC) != 0) {
+		log_printf(log_error, "Failed to sync '%s': %s", map->name, strerror(errno));
+	}
+#else
+	(void)map;
+#endif
+}
+
+// Loads the level from its sidecar, if there's one that isn't older than the .cw file. With mapped
+// storage this is instant, the blocks are only read in as they're touched.
+map_t *map_sidecar_load(const char *name) {
+	char path[256], cw_path[256];
+	sidecar_path(name, path, sizeof(path));
+	snprintf(cw_path, sizeof(cw_path), "%s.cw", name);
+
+	struct stat st, cw_st;
+	if (stat(path, &st) != 0) {
+		return NULL;
+	}
+
+	if (stat(cw_path, &cw_st) == 0 && file_newer(&cw_st, &st)) {
+		log_printf(log_info, "'%s' is newer than '%s', loading it instead", cw_path, path);
+		return NULL;
+	}
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+
+	sidecarheader_t header;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 || header.version != SIDECAR_VERSION) {
+		log_printf(log_error, "Ignoring invalid sidecar '%s'", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	const size_t num_blocks = (size_t)header.width * header.depth * header.height;
+	if (num_blocks == 0 || (size_t)st.st_size < sizeof(header) + num_blocks + sizeof(int32_t) * 2 * header.num_ticks) {
+		log_printf(log_error, "Ignoring truncated sidecar '%s'", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	map_t *map;
+	if (strcmp(config.map.storage, "mapped") == 0) {
+		map = map_reopen(name, header.width, header.depth, header.height);
+	}
+	else {
+		map = map_create(name, header.width, header.depth, header.height);
+	}
+
+	// Other storage (or a mapping that failed) has to read the blocks in.
+	if (map->mapping == NULL) {
+		uint8_t *blocks = malloc(num_blocks);
+		if (fread(blocks, 1, num_blocks, fp) != num_blocks) {
+			log_printf(log_error, "Failed to read '%s'", path);
+			free(blocks);
+			map_destroy(map);
+			fclose(fp);
+			return NULL;
+		}
+
+		map_load_blocks(map, blocks);
+		free(blocks);
+	}
+
+	fseek(fp, (long)(sizeof(header) + num_blocks), SEEK_SET);
+	for (uint32_t i = 0; i < header.num_ticks; i++) {
+		int32_t tick[2];
+		if (fread(tick, sizeof(tick), 1, fp) != 1) {
+			break;
+		}
+
+		size_t x, y, z;
+		map_index_to_pos(map, (size_t)tick[0], &x, &y, &z);
+		map_add_tick(map, x, y, z, tick[1]);
+	}
+
+	fclose(fp);
+
+	log_printf(log_info, "Loaded level from '%s'", path);
+	map->modified = false;
+
+	return map;
+}
@@ -205,7 +205,7 @@ void nbt_write(tag_t *tag, buffer_t *buffer) {
 
 		case tag_byte_array: {
 			buffer_write_int32be(buffer, tag->array_size);
-			buffer_write(buffer, tag->pb, tag->array_size);
+			buffer_write_ref(buffer, tag->pb, tag->array_size);
 			break;
 		}
 
@@ -0,0 +1,178 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <string.h>
+#include "packet.h"
+#include "buffer.h"
+
+// Fields are stored a byte at a time so the result is big endian whatever the host is, the compiler
+// merges neighbouring stores.
+
+static inline uint8_t *put_u8(uint8_t *out, uint8_t value) {
+	out[0] = value;
+	return out + 1;
+}
+
+static inline uint8_t *put_i8(uint8_t *out, int8_t value) {
+	return put_u8(out, (uint8_t)value);
+}
+
+static inline uint8_t *put_u16(uint8_t *out, uint16_t value) {
+	out[0] = (uint8_t)(value >> 8);
+	out[1] = (uint8_t)value;
+	return out + 2;
+}
+
+static inline uint8_t *put_i16(uint8_t *out, int16_t value) {
+	return put_u16(out, (uint16_t)value);
+}
+
+static inline uint8_t *put_u32(uint8_t *out, uint32_t value) {
+	out[0] = (uint8_t)(value >> 24);
+	out[1] = (uint8_t)(value >> 16);
+	out[2] = (uint8_t)(value >> 8);
+	out[3] = (uint8_t)value;
+	return out + 4;
+}
+
+static inline uint8_t *put_i32(uint8_t *out, int32_t value) {
+	return put_u32(out, (uint32_t)value);
+}
+
+static inline uint8_t *put_str(uint8_t *out, const char *value) {
+	const size_t len = strnlen(value, 64);
+	memcpy(out, value, len);
+	memset(out + len, ' ', 64 - len);
+	return out + 64;
+}
+
+static inline uint8_t *put_bytes1024(uint8_t *out, const uint8_t *value) {
+	memcpy(out, value, 1024);
+	return out + 1024;
+}
+
+static inline uint8_t *put_u32x256(uint8_t *out, const uint32_t *value) {
+	for (size_t i = 0; i < 256; i++) {
+		out = put_u32(out, value[i]);
+	}
+	return out;
+}
+
+static inline uint8_t *put_u8x256(uint8_t *out, const uint8_t *value) {
+	memcpy(out, value, 256);
+	return out + 256;
+}
+
+static inline const uint8_t *get_u8(const uint8_t *in, uint8_t *value) {
+	*value = in[0];
+	return in + 1;
+}
+
+static inline const uint8_t *get_i8(const uint8_t *in, int8_t *value) {
+	*value = (int8_t)in[0];
+	return in + 1;
+}
+
+static inline const uint8_t *get_u16(const uint8_t *in, uint16_t *value) {
+	*value = (uint16_t)(in[0] << 8 | in[1]);
+	return in + 2;
+}
+
+static inline const uint8_t *get_i16(const uint8_t *in, int16_t *value) {
+	*value = (int16_t)(in[0] << 8 | in[1]);
+	return in + 2;
+}
+
+static inline const uint8_t *get_u32(const uint8_t *in, uint32_t *value) {
+	*value = (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+	return in + 4;
+}
+
+static inline const uint8_t *get_i32(const uint8_t *in, int32_t *value) {
+	uint32_t u;
+	in = get_u32(in, &u);
+	*value = (int32_t)u;
+	return in;
+}
+
+// Trailing padding is dropped.
+static inline const uint8_t *get_str(const uint8_t *in, char (*value)[65]) {
+	size_t len = 64;
+	while (len > 0 && in[len - 1] == ' ') {
+		len--;
+	}
+
+	memcpy(*value, in, len);
+	(*value)[len] = '\0';
+	return in + 64;
+}
+
+static inline const uint8_t *get_bytes1024(const uint8_t *in, uint8_t (*value)[1024]) {
+	memcpy(*value, in, 1024);
+	return in + 1024;
+}
+
+static inline const uint8_t *get_u32x256(const uint8_t *in, uint32_t (*value)[256]) {
+	for (size_t i = 0; i < 256; i++) {
+		in = get_u32(in, &(*value)[i]);
+	}
+	return in;
+}
+
+static inline const uint8_t *get_u8x256(const uint8_t *in, uint8_t (*value)[256]) {
+	memcpy(*value, in, 256);
+	return in + 256;
+}
+
+#define PACKET_PUT(type, name) out = put_##type(out, name);
+#define PACKET_GET(type, name) in = get_##type(in, &packet->name);
+
+#define PACKET_DEFINE_FUNCTIONS(name, packet_id, fields)                              \
+	bool packet_write_##name(buffer_t *buffer fields(PACKET_ADD_PARAM)) {             \
+		uint8_t *out = buffer_reserve(buffer, packet_##name##_size);                  \
+		if (out == NULL) {                                                            \
+			return false;                                                             \
+		}                                                                             \
+		*out++ = packet_id;                                                           \
+		fields(PACKET_PUT)                                                            \
+		return true;                                                                  \
+	}                                                                                 \
+                                                                                      \
+	bool packet_read_##name(buffer_t *buffer, packet_##name##_t *packet) {            \
+		const uint8_t *in = buffer_consume(buffer, packet_##name##_size - 1);         \
+		if (in == NULL) {                                                             \
+			return false;                                                             \
+		}                                                                             \
+		packet->id = packet_id;                                                       \
+		fields(PACKET_GET)                                                            \
+		return true;                                                                  \
+	}
+
+PACKETS(PACKET_DEFINE_FUNCTIONS)
+
+const char *packet_text(char out[65], const char *text, bool filter) {
+	if (!filter) {
+		return text;
+	}
+
+	size_t i = 0;
+	for (; i < 64 && text[i] != '\0'; i++) {
+		out[i] = text[i] < 0 ? '?' : text[i];
+	}
+	out[i] = '\0';
+
+	return out;
+}
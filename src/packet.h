@@ -15,6 +15,11 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct buffer_s;
 
 enum {
 	packet_ident = 0x00,
@@ -39,7 +44,119 @@ enum {
 
 	packet_custom_block_support_level = 0x13,
 
+	packet_bulk_block_update = 0x26,
 	packet_set_text_colour = 0x27,
 
 	packet_two_way_ping = 0x2b,
 };
+
+// Every packet layout, as X(name, id, fields). fields(F) lists F(type, field) in wire order, types are
+// u8, i8, u16, i16, u32, i32 (big endian), str (64 bytes, space padded), bytes1024, u32x256 and u8x256.
+// Each entry generates:
+//   packet_<name>_size                   size on the wire, including the id
+//   packet_<name>_t                      the decoded fields
+//   packet_write_<name>(buffer, ...)     appends the whole packet, false if it doesn't fit
+//   packet_read_<name>(buffer, packet)   reads everything after the id, false if the packet is cut short
+// Packets that change layout with the protocol version or extensions get an entry per layout.
+#define PACKETS(X) \
+	X(ident, packet_ident, PACKET_IDENT) \
+	X(ping, packet_ping, PACKET_NO_FIELDS) \
+	X(level_init, packet_level_init, PACKET_NO_FIELDS) \
+	X(level_init_fastmap, packet_level_init, PACKET_LEVEL_INIT_FASTMAP) \
+	X(level_chunk, packet_level_chunk, PACKET_LEVEL_CHUNK) \
+	X(level_finish, packet_level_finish, PACKET_LEVEL_FINISH) \
+	X(set_block_client, packet_set_block_client, PACKET_SET_BLOCK_CLIENT) \
+	X(set_block_server, packet_set_block_server, PACKET_SET_BLOCK_SERVER) \
+	X(player_spawn, packet_player_spawn, PACKET_PLAYER_SPAWN) \
+	X(player_pos_angle, packet_player_pos_angle, PACKET_PLAYER_POS_ANGLE) \
+	X(player_pos_angle_update, packet_player_pos_angle_update, PACKET_PLAYER_POS_ANGLE_UPDATE) \
+	X(player_pos_update, packet_player_pos_update, PACKET_PLAYER_POS_UPDATE) \
+	X(player_angle_update, packet_player_angle_update, PACKET_PLAYER_ANGLE_UPDATE) \
+	X(player_despawn, packet_player_despawn, PACKET_PLAYER_DESPAWN) \
+	X(message, packet_message, PACKET_MESSAGE) \
+	X(player_disconnect, packet_player_disconnect, PACKET_PLAYER_DISCONNECT) \
+	X(player_set_type, packet_player_set_type, PACKET_PLAYER_SET_TYPE) \
+	X(extinfo, packet_extinfo, PACKET_EXTINFO) \
+	X(extentry, packet_extentry, PACKET_EXTENTRY) \
+	X(custom_block_support_level, packet_custom_block_support_level, PACKET_CUSTOM_BLOCK_SUPPORT_LEVEL) \
+	X(bulk_block_update, packet_bulk_block_update, PACKET_BULK_BLOCK_UPDATE) \
+	X(set_text_colour, packet_set_text_colour, PACKET_SET_TEXT_COLOUR) \
+	X(two_way_ping, packet_two_way_ping, PACKET_TWO_WAY_PING)
+
+#define PACKET_NO_FIELDS(F)
+// Protocol 6 and later, older clients send and expect less.
+#define PACKET_IDENT(F) F(u8, protocol) F(str, name) F(str, motd) F(u8, user_type)
+#define PACKET_LEVEL_INIT_FASTMAP(F) F(u32, volume)
+#define PACKET_LEVEL_CHUNK(F) F(u16, length) F(bytes1024, data) F(u8, percent)
+#define PACKET_LEVEL_FINISH(F) F(u16, width) F(u16, depth) F(u16, height)
+#define PACKET_SET_BLOCK_CLIENT(F) F(u16, x) F(u16, y) F(u16, z) F(u8, mode) F(u8, block)
+#define PACKET_SET_BLOCK_SERVER(F) F(u16, x) F(u16, y) F(u16, z) F(u8, block)
+#define PACKET_PLAYER_SPAWN(F) F(u8, player) F(str, name) F(i16, x) F(i16, y) F(i16, z) F(i8, yaw) F(i8, pitch)
+#define PACKET_PLAYER_POS_ANGLE(F) F(u8, player) F(i16, x) F(i16, y) F(i16, z) F(i8, yaw) F(i8, pitch)
+#define PACKET_PLAYER_POS_ANGLE_UPDATE(F) F(u8, player) F(i8, dx) F(i8, dy) F(i8, dz) F(i8, yaw) F(i8, pitch)
+#define PACKET_PLAYER_POS_UPDATE(F) F(u8, player) F(i8, dx) F(i8, dy) F(i8, dz)
+#define PACKET_PLAYER_ANGLE_UPDATE(F) F(u8, player) F(i8, yaw) F(i8, pitch)
+#define PACKET_PLAYER_DESPAWN(F) F(u8, player)
+#define PACKET_MESSAGE(F) F(u8, player) F(str, text)
+#define PACKET_PLAYER_DISCONNECT(F) F(str, reason)
+#define PACKET_PLAYER_SET_TYPE(F) F(u8, user_type)
+#define PACKET_EXTINFO(F) F(str, app_name) F(u16, count)
+#define PACKET_EXTENTRY(F) F(str, name) F(i32, version)
+#define PACKET_CUSTOM_BLOCK_SUPPORT_LEVEL(F) F(u8, level)
+#define PACKET_BULK_BLOCK_UPDATE(F) F(u8, count) F(u32x256, indices) F(u8x256, blocks)
+#define PACKET_SET_TEXT_COLOUR(F) F(u8, r) F(u8, g) F(u8, b) F(u8, a) F(u8, code)
+#define PACKET_TWO_WAY_PING(F) F(u8, direction) F(u16, data)
+
+// How each wire type is passed to packet_write_*, stored in packet_*_t, and how long it is.
+#define PACKET_PARAM_u8 uint8_t
+#define PACKET_PARAM_i8 int8_t
+#define PACKET_PARAM_u16 uint16_t
+#define PACKET_PARAM_i16 int16_t
+#define PACKET_PARAM_u32 uint32_t
+#define PACKET_PARAM_i32 int32_t
+#define PACKET_PARAM_str const char *
+#define PACKET_PARAM_bytes1024 const uint8_t *
+#define PACKET_PARAM_u32x256 const uint32_t *
+#define PACKET_PARAM_u8x256 const uint8_t *
+
+#define PACKET_FIELD_u8(name) uint8_t name;
+#define PACKET_FIELD_i8(name) int8_t name;
+#define PACKET_FIELD_u16(name) uint16_t name;
+#define PACKET_FIELD_i16(name) int16_t name;
+#define PACKET_FIELD_u32(name) uint32_t name;
+#define PACKET_FIELD_i32(name) int32_t name;
+#define PACKET_FIELD_str(name) char name[65];
+#define PACKET_FIELD_bytes1024(name) uint8_t name[1024];
+#define PACKET_FIELD_u32x256(name) uint32_t name[256];
+#define PACKET_FIELD_u8x256(name) uint8_t name[256];
+
+#define PACKET_SIZE_u8 1
+#define PACKET_SIZE_i8 1
+#define PACKET_SIZE_u16 2
+#define PACKET_SIZE_i16 2
+#define PACKET_SIZE_u32 4
+#define PACKET_SIZE_i32 4
+#define PACKET_SIZE_str 64
+#define PACKET_SIZE_bytes1024 1024
+#define PACKET_SIZE_u32x256 (256 * 4)
+#define PACKET_SIZE_u8x256 256
+
+#define PACKET_ADD_SIZE(type, name) + PACKET_SIZE_##type
+#define PACKET_DECLARE_SIZE(name, packet_id, fields) packet_##name##_size = 1 fields(PACKET_ADD_SIZE),
+enum {
+	PACKETS(PACKET_DECLARE_SIZE)
+};
+
+#define PACKET_ADD_FIELD(type, name) PACKET_FIELD_##type(name)
+#define PACKET_DECLARE_STRUCT(name, packet_id, fields) typedef struct { uint8_t id; fields(PACKET_ADD_FIELD) } packet_##name##_t;
+PACKETS(PACKET_DECLARE_STRUCT)
+
+#define PACKET_ADD_PARAM(type, name) , PACKET_PARAM_##type name
+#define PACKET_DECLARE_FUNCTIONS(name, packet_id, fields) \
+	bool packet_write_##name(struct buffer_s *buffer fields(PACKET_ADD_PARAM)); \
+	bool packet_read_##name(struct buffer_s *buffer, packet_##name##_t *packet);
+PACKETS(PACKET_DECLARE_FUNCTIONS)
+
+// Returns text ready for a str field: as is, or with everything outside ASCII replaced for clients
+// without FullCP437, using out as storage.
+const char *packet_text(char out[65], const char *text, bool filter);
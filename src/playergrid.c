@@ -0,0 +1,106 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include "playergrid.h"
+#include "client.h"
+#include "util.h"
+
+playergrid_t *playergrid_create(size_t width, size_t height, float cell_size) {
+	playergrid_t *grid = malloc(sizeof(*grid));
+	grid->cell_size = cell_size;
+	grid->cells_x = util_max((size_t)((float)width / cell_size) + 1, 1);
+	grid->cells_z = util_max((size_t)((float)height / cell_size) + 1, 1);
+	grid->cells = calloc(grid->cells_x * grid->cells_z, sizeof(*grid->cells));
+	return grid;
+}
+
+void playergrid_destroy(playergrid_t *grid) {
+	free(grid->cells);
+	free(grid);
+}
+
+// Players can stand outside the level, they go in the nearest cell.
+static size_t playergrid_cell_coord(playergrid_t *grid, float pos, size_t cells) {
+	if (pos <= 0.0f) {
+		return 0;
+	}
+
+	return util_min((size_t)(pos / grid->cell_size), cells - 1);
+}
+
+static size_t playergrid_cell(playergrid_t *grid, float x, float z) {
+	return playergrid_cell_coord(grid, z, grid->cells_z) * grid->cells_x + playergrid_cell_coord(grid, x, grid->cells_x);
+}
+
+void playergrid_update(playergrid_t *grid, client_t *client, float x, float z) {
+	const size_t cell = playergrid_cell(grid, x, z);
+	if (client->in_grid && client->grid_cell == cell) {
+		return;
+	}
+
+	playergrid_remove(grid, client);
+
+	client->in_grid = true;
+	client->grid_cell = cell;
+	client->grid_prev = NULL;
+	client->grid_next = grid->cells[cell];
+	if (client->grid_next != NULL) {
+		client->grid_next->grid_prev = client;
+	}
+	grid->cells[cell] = client;
+}
+
+void playergrid_remove(playergrid_t *grid, client_t *client) {
+	if (!client->in_grid) {
+		return;
+	}
+
+	if (client->grid_prev != NULL) {
+		client->grid_prev->grid_next = client->grid_next;
+	}
+	else {
+		grid->cells[client->grid_cell] = client->grid_next;
+	}
+
+	if (client->grid_next != NULL) {
+		client->grid_next->grid_prev = client->grid_prev;
+	}
+
+	client->in_grid = false;
+}
+
+// Collects up to max players from the cells within radius of (x, z). That's everyone who may be that
+// close, callers check the actual distance. A radius of 0 or less returns every player.
+size_t playergrid_query(playergrid_t *grid, float x, float z, float radius, client_t **out, size_t max) {
+	size_t x0 = 0, z0 = 0, x1 = grid->cells_x - 1, z1 = grid->cells_z - 1;
+	if (radius > 0.0f) {
+		x0 = playergrid_cell_coord(grid, x - radius, grid->cells_x);
+		x1 = playergrid_cell_coord(grid, x + radius, grid->cells_x);
+		z0 = playergrid_cell_coord(grid, z - radius, grid->cells_z);
+		z1 = playergrid_cell_coord(grid, z + radius, grid->cells_z);
+	}
+
+	size_t n = 0;
+	for (size_t cz = z0; cz <= z1; cz++)
+	for (size_t cx = x0; cx <= x1; cx++) {
+		for (client_t *client = grid->cells[cz * grid->cells_x + cx]; client != NULL && n < max; client = client->grid_next) {
+			out[n++] = client;
+		}
+	}
+
+	return n;
+}
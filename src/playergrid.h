@@ -0,0 +1,35 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <stddef.h>
+
+struct client_s;
+
+// A uniform grid over the level's x/z plane holding the spawned players, so finding the players near
+// someone only has to look at the cells around them. Clients are linked into their cell directly.
+typedef struct playergrid_s {
+	float cell_size;
+	size_t cells_x, cells_z;
+	struct client_s **cells;
+} playergrid_t;
+
+playergrid_t *playergrid_create(size_t width, size_t height, float cell_size);
+void playergrid_destroy(playergrid_t *grid);
+
+void playergrid_update(playergrid_t *grid, struct client_s *client, float x, float z);
+void playergrid_remove(playergrid_t *grid, struct client_s *client);
+size_t playergrid_query(playergrid_t *grid, float x, float z, float radius, struct client_s **out, size_t max);
@@ -0,0 +1,69 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include <stdlib.h>
+#include "pool.h"
+
+pool_t *pool_create(size_t object_size, size_t max_free) {
+	pool_t *pool = malloc(sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->object_size = object_size;
+	pool->free = malloc(sizeof(*pool->free) * max_free);
+	pool->num_free = 0;
+	pool->max_free = max_free;
+	pool->owner = pthread_self();
+
+	return pool;
+}
+
+void pool_destroy(pool_t *pool) {
+	if (pool == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < pool->num_free; i++) {
+		free(pool->free[i]);
+	}
+
+	free(pool->free);
+	free(pool);
+}
+
+// The contents of the block are whatever was left in it.
+void *pool_alloc(pool_t *pool) {
+	if (pool->num_free > 0 && pthread_equal(pthread_self(), pool->owner)) {
+		return pool->free[--pool->num_free];
+	}
+
+	return malloc(pool->object_size);
+}
+
+void pool_free(pool_t *pool, void *object) {
+	if (object == NULL) {
+		return;
+	}
+
+	if (pool->num_free < pool->max_free && pthread_equal(pthread_self(), pool->owner)) {
+		pool->free[pool->num_free++] = object;
+	}
+	else {
+		free(object);
+	}
+}
@@ -0,0 +1,37 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+#include <stddef.h>
+#include <pthread.h>
+
+// Keeps up to max_free blocks of one size around after they're freed so the next allocation can reuse
+// them. Only the thread that created the pool touches the free list, other threads get plain malloc
+// and free, so a block that ends up being freed on a worker is still safe.
+typedef struct pool_s {
+	size_t object_size;
+	void **free;
+	size_t num_free;
+	size_t max_free;
+	pthread_t owner;
+} pool_t;
+
+pool_t *pool_create(size_t object_size, size_t max_free);
+void pool_destroy(pool_t *pool);
+
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
@@ -34,20 +34,30 @@
 #include "config.h"
 #include "log.h"
 #include "namelist.h"
+#include "worker.h"
 #include "mapimage.h"
+#include "playergrid.h"
 
 #ifndef _WIN32
 #include <netinet/tcp.h>
 #endif
 
 #define HEARTBEAT_INTERVAL (45.0)
+// Client buffers start out this big, the pools keep freed ones around for the next connections.
+#define CLIENT_BUFFER_BLOCK (4 * 1024)
+#define POOL_MAX_CLIENTS 32
 
 void server_accept(void);
+void server_process_join_queue(void);
+void server_send_block_changes(void);
+void server_send_movement(void);
 void server_generate_salt(char *out, size_t length);
 
 server_t server;
 
 bool server_init(void) {
+	worker_init(config.server.worker_threads);
+
 	server.port = config.server.port;
 	server.global_rng = rng_create((int)time(NULL));
 	server.last_heartbeat = 0.0;
@@ -121,6 +131,15 @@ bool server_init(void) {
 		map_save(server.map);
 	}
 
+	// With unlimited view distance everyone goes in one cell.
+	const float cell_size = config.server.view_distance > 0 ? (float)config.server.view_distance : (float)util_max(server.map->width, server.map->height);
+	server.players = playergrid_create(server.map->width, server.map->height, cell_size);
+	server.clients = malloc(sizeof(*server.clients) * config.server.max_connections);
+	server.num_clients = 0;
+	server.entities = slottable_create(SERVER_MAX_ENTITIES);
+	server.client_pool = pool_create(sizeof(client_t), POOL_MAX_CLIENTS);
+	server.buffer_pool = pool_create(CLIENT_BUFFER_BLOCK, POOL_MAX_CLIENTS * 2);
+
 	server.ops = namelist_create("ops.txt");
 	server.banned_users = namelist_create("banned_users.txt");
 	server.banned_ips = namelist_create("banned_ips.txt");
@@ -133,10 +152,29 @@ bool server_init(void) {
 }
 
 void server_shutdown(void) {
+	// Level transfers give up once their client is gone, which lets the workers finish.
+	for (size_t i = 0; i < server.num_clients; i++) {
+		server.clients[i]->connected = false;
+	}
+
+	worker_shutdown();
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_destroy(server.clients[i]);
+		pool_free(server.client_pool, server.clients[i]);
+	}
+	server.num_clients = 0;
+
 	namelist_destroy(server.whitelist);
 	namelist_destroy(server.banned_ips);
 	namelist_destroy(server.banned_users);
 	namelist_destroy(server.ops);
+	playergrid_destroy(server.players);
+	free(server.clients);
+	free(server.spectator_dirty);
+	slottable_destroy(server.entities);
+	pool_destroy(server.client_pool);
+	pool_destroy(server.buffer_pool);
 	map_save(server.map);
 	map_destroy(server.map);
 	closesocket(server.socket_fd);
@@ -144,36 +182,42 @@ void server_shutdown(void) {
 }
 
 void server_tick(void) {
+	worker_poll();
 	server_accept();
 	map_tick(server.map);
 
+	// Clients take turns going first, so the same one doesn't always get its input in before the others.
+	server.throttled_clients = 0;
 	for (size_t i = 0; i < server.num_clients; i++) {
-		client_tick(&server.clients[i]);
+		client_tick(server.clients[(i + server.tick) % server.num_clients]);
 	}
 
+	server_process_join_queue();
+	server_send_block_changes();
+	server_send_movement();
+
 	bool removed = false;
-	for (size_t i = 0; i < server.num_clients; i++) {
-		client_t *client = &server.clients[i];
-		if (client->connected) {
+	for (size_t i = server.num_clients; i-- > 0;) {
+		client_t *client = server.clients[i];
+
+		// A level transfer thread may still be using the client, it finishes soon after noticing the disconnect.
+		if (client->connected || client->mapsend_state == mapsend_running) {
 			continue;
 		}
 
+		if (client->send_error != NULL) {
+			client_disconnect(client, client->send_error);
+		}
+
 		client_destroy(client);
+		pool_free(server.client_pool, client);
 
-		memmove(server.clients + i, server.clients + i + 1, (server.num_clients - i - 1) * sizeof(*server.clients));
-		server.num_clients--;
+		server.clients[i] = server.clients[--server.num_clients];
 		removed = true;
 	}
 
-	if (removed) {
-		if (server.num_clients == 0) {
-			free(server.clients);
-			server.clients = NULL;
-			map_save(server.map);
-		}
-		else {
-			server.clients = realloc(server.clients, sizeof(*server.clients) * server.num_clients);
-		}
+	if (removed && server.num_clients == 0) {
+		map_save(server.map);
 	}
 
 	if (get_time_s() - server.last_heartbeat > HEARTBEAT_INTERVAL) {
@@ -184,6 +228,145 @@ void server_tick(void) {
 	server.tick++;
 }
 
+// Encodes the blocks changed this tick once and hands the same packets to everyone who has the level.
+// Clients still downloading it get the changes replayed once it has arrived.
+// Spectators get them every spectator_interval ticks instead, a position that changed several times in
+// between is only sent once.
+void server_send_block_changes(void) {
+	size_t num_dirty;
+	const uint32_t *dirty = map_take_dirty(server.map, &num_dirty);
+
+	if (num_dirty > 0) {
+		blockchanges_t changes;
+		client_encode_block_changes(&changes, server.map, dirty, num_dirty);
+
+		for (size_t i = 0; i < server.num_clients; i++) {
+			client_t *client = server.clients[i];
+			if (client->connected && !client->spectator && client->mapsend_state == mapsend_sent) {
+				client_send_block_changes(client, &changes);
+			}
+		}
+
+		client_free_block_changes(&changes);
+	}
+
+	if (server.num_spectators > 0 && num_dirty > 0) {
+		if (server.num_spectator_dirty + num_dirty > server.spectator_dirty_size) {
+			server.spectator_dirty_size = util_max(server.spectator_dirty_size * 2, server.num_spectator_dirty + num_dirty);
+			server.spectator_dirty = realloc(server.spectator_dirty, sizeof(*server.spectator_dirty) * server.spectator_dirty_size);
+		}
+		memcpy(server.spectator_dirty + server.num_spectator_dirty, dirty, sizeof(*dirty) * num_dirty);
+		server.num_spectator_dirty += num_dirty;
+	}
+
+	if (server.num_spectator_dirty == 0 || server.tick % config.server.spectator_interval != 0) {
+		return;
+	}
+
+	const size_t num = map_sort_unique_indices(server.spectator_dirty, server.num_spectator_dirty);
+	server.num_spectator_dirty = 0;
+
+	blockchanges_t changes;
+	client_encode_block_changes(&changes, server.map, server.spectator_dirty, num);
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_t *client = server.clients[i];
+		if (client->connected && client->spectator && client->mapsend_state == mapsend_sent) {
+			client_send_block_changes(client, &changes);
+		}
+	}
+
+	client_free_block_changes(&changes);
+}
+
+// Players only report where they are, the latest pose of each is passed on once at the end of the tick.
+// Each observer is only told about players within view distance: they are spawned when they come into
+// range and despawned once they are a bit further out again, so someone on the edge doesn't flicker.
+// Observers further than far_player_distance get movement less often, what they missed is folded into
+// their next update. Spectators see all players, every spectator_interval ticks.
+void server_send_movement(void) {
+	const float far = (float)config.server.far_player_distance;
+	const bool far_due = server.tick % config.server.far_player_interval == 0;
+	const bool spectators_due = server.tick % config.server.spectator_interval == 0;
+
+	if (server.num_clients == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_t *client = server.clients[i];
+		if (client->connected && client->spawned && !client->spectator) {
+			playergrid_update(server.players, client, server.poses.x[client->entity_id], server.poses.z[client->entity_id]);
+		}
+		else {
+			playergrid_remove(server.players, client);
+		}
+	}
+
+	client_t **near = malloc(sizeof(*near) * server.num_clients);
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_t *observer = server.clients[i];
+		if (!observer->connected || !observer->spawned || (observer->spectator && !spectators_due)) {
+			continue;
+		}
+
+		const int self = observer->entity_id;
+		// Spectators aren't anywhere in particular, they get everyone.
+		const float view = observer->spectator ? 0.0f : (float)config.server.view_distance;
+		const float forget = view * 1.25f;
+		float ox = 0.0f, oy = 0.0f, oz = 0.0f;
+		if (!observer->spectator) {
+			ox = server.poses.x[self];
+			oy = server.poses.y[self];
+			oz = server.poses.z[self];
+		}
+
+		const size_t num_near = playergrid_query(server.players, ox, oz, forget, near, server.num_clients);
+		for (size_t j = 0; j < num_near; j++) {
+			const int id = near[j]->entity_id;
+			if (id == self) {
+				continue;
+			}
+
+			// The id may have been handed on since this observer last saw it.
+			entityview_t *view_of = &observer->views[id];
+			if (view_of->visible && view_of->generation != server.entities->generations[id]) {
+				client_send_despawn(observer, (uint8_t)id);
+			}
+
+			const float dx = server.poses.x[id] - ox, dy = server.poses.y[id] - oy, dz = server.poses.z[id] - oz;
+			const float distance_sq = dx * dx + dy * dy + dz * dz;
+
+			if (!view_of->visible) {
+				if (view > 0.0f && distance_sq > view * view) {
+					continue;
+				}
+				client_send_spawn(observer, near[j]);
+			}
+			else if (view > 0.0f && distance_sq > forget * forget) {
+				continue;
+			}
+			else if (far <= 0.0f || far_due || observer->spectator || distance_sq <= far * far) {
+				client_send_movement(observer, near[j]);
+			}
+
+			view_of->seen_tick = server.tick;
+		}
+
+		// Whoever wasn't found nearby has left the area or the server.
+		for (size_t id = 0; id < 256; id++) {
+			if (observer->views[id].visible && observer->views[id].seen_tick != server.tick) {
+				client_send_despawn(observer, (uint8_t)id);
+			}
+		}
+
+		client_flush(observer);
+	}
+
+	free(near);
+}
+
 void server_accept(void) {
 	struct sockaddr_storage client_addr;
 	socklen_t addr_size = sizeof(client_addr);
@@ -218,10 +401,15 @@ void server_accept(void) {
 
 	log_printf(log_info, "Incoming connection from %s:%u", addrstr, sin->sin_port);
 
-	size_t conn_idx = server.num_clients++;
-	server.clients = realloc(server.clients, server.num_clients * sizeof(*server.clients));
-	client_t *client = &server.clients[conn_idx];
-	client_init(client, acceptfd, conn_idx);
+	if (server.num_clients == config.server.max_connections) {
+		log_printf(log_info, "Too many connections, closing %s:%u", addrstr, sin->sin_port);
+		closesocket(acceptfd);
+		return;
+	}
+
+	client_t *client = pool_alloc(server.client_pool);
+	server.clients[server.num_clients++] = client;
+	client_init(client, acceptfd);
 	memcpy(client->address, ip, sizeof(client->address));
 	client->port = sin->sin_port;
 
@@ -231,6 +419,70 @@ void server_accept(void) {
 	}
 }
 
+// Starts queued level transfers in join order, while staying within the configured number of
+// concurrent transfers and memory budget. At least one transfer is always allowed to run.
+void server_process_join_queue(void) {
+	size_t active = 0;
+	size_t queued = 0;
+	size_t memory = 0;
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_t *client = server.clients[i];
+		if (client->mapsend_state == mapsend_running || client->mapsend_state == mapsend_success) {
+			active++;
+			memory += client->mapsend_memory;
+		}
+		else if (client->connected && client->mapsend_state == mapsend_queued) {
+			queued++;
+		}
+	}
+
+	mapsend_update_pressure(active + queued);
+	mapsend_cache_expire();
+
+	const size_t budget = (size_t)config.server.level_transfer_memory * 1024 * 1024;
+
+	while (active < config.server.max_level_transfers) {
+		client_t *next = NULL;
+		for (size_t i = 0; i < server.num_clients; i++) {
+			client_t *client = server.clients[i];
+			if (client->connected && client->mapsend_state == mapsend_queued && (next == NULL || client->join_ticket < next->join_ticket)) {
+				next = client;
+			}
+		}
+
+		if (next == NULL) {
+			break;
+		}
+
+		const size_t estimate = client_level_memory_estimate(next);
+		if (active > 0 && memory + estimate > budget) {
+			break;
+		}
+
+		client_start_level(next);
+		active++;
+		memory += estimate;
+	}
+
+	for (size_t i = 0; i < server.num_clients; i++) {
+		client_t *client = server.clients[i];
+		if (!client->connected || client->mapsend_state != mapsend_queued) {
+			continue;
+		}
+
+		size_t position = 1;
+		for (size_t j = 0; j < server.num_clients; j++) {
+			client_t *other = server.clients[j];
+			if (other->connected && other->mapsend_state == mapsend_queued && other->join_ticket < client->join_ticket) {
+				position++;
+			}
+		}
+
+		client_notify_queue_position(client, position);
+	}
+}
+
 void server_broadcast(const char *msg, ...) {
 	char buffer[65];
 
@@ -242,14 +494,13 @@ void server_broadcast(const char *msg, ...) {
 	log_printf(log_info, "%s", buffer);
 
 	for (size_t i = 0; i < server.num_clients; i++) {
-		client_t *client = &server.clients[i];
+		client_t *client = server.clients[i];
 		if (client->protocol_version < 3) {
 			continue;
 		}
 
-		buffer_write_uint8(client->out_buffer, packet_message);
-		buffer_write_uint8(client->out_buffer, 0x7F);
-		buffer_write_mcstr(client->out_buffer, buffer, !client_supports_extension(client, "FullCP437", 1));
+		char text[65];
+		packet_write_message(client->out_buffer, 0x7f, packet_text(text, buffer, !client_supports_extension(client, cpeext_full_cp437)));
 		client_flush(client);
 	}
 }
@@ -18,23 +18,48 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "sockets.h"
+#include "pool.h"
+#include "slottable.h"
+
+// Entity id 255 means the player itself, which leaves 255 to hand out.
+#define SERVER_MAX_ENTITIES 255
 
 typedef struct client_s client_t;
 typedef struct map_s map_t;
 typedef struct rng_s rng_t;
 typedef struct namelist_s namelist_t;
+typedef struct playergrid_s playergrid_t;
+
+// Where each player is, by entity id. Kept out of client_t so the movement broadcast reads a few small
+// arrays rather than every client.
+typedef struct entityposes_s {
+	float x[SERVER_MAX_ENTITIES], y[SERVER_MAX_ENTITIES], z[SERVER_MAX_ENTITIES];
+	float yaw[SERVER_MAX_ENTITIES], pitch[SERVER_MAX_ENTITIES];
+} entityposes_t;
 
 typedef struct server_s {
 	socket_t socket_fd;
 	uint16_t port;
 
 	uint64_t tick;
+	double tick_time; // moving average of how long a tick takes, in seconds
+	uint64_t skipped_ticks; // dropped because the server fell too far behind
+	size_t throttled_clients; // whose input was held back this tick
 
-	client_t *clients;
+	client_t **clients; // max_connections long, in no particular order
 	size_t num_clients;
+	slottable_t *entities; // ids of logged in players
+	size_t num_spectators;
+	uint32_t *spectator_dirty; // block changes since spectators were last sent them
+	size_t num_spectator_dirty, spectator_dirty_size;
+	entityposes_t poses;
+	pool_t *client_pool;
+	pool_t *buffer_pool; // the first block of every client's in_buffer and out_buffer
+	uint64_t next_join_ticket;
 
 	map_t *map;
 	rng_t *global_rng;
+	playergrid_t *players;
 
 	char salt[17];
 	double last_heartbeat;
@@ -0,0 +1,65 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include <stdlib.h>
+#include "slottable.h"
+
+slottable_t *slottable_create(size_t capacity) {
+	slottable_t *table = malloc(sizeof(*table));
+	if (table == NULL) {
+		return NULL;
+	}
+
+	table->capacity = capacity;
+	table->free = malloc(sizeof(*table->free) * capacity);
+	table->free_head = 0;
+	table->num_free = capacity;
+	table->generations = calloc(capacity, sizeof(*table->generations));
+
+	for (size_t i = 0; i < capacity; i++) {
+		table->free[i] = i;
+	}
+
+	return table;
+}
+
+void slottable_destroy(slottable_t *table) {
+	if (table == NULL) {
+		return;
+	}
+
+	free(table->free);
+	free(table->generations);
+	free(table);
+}
+
+bool slottable_alloc(slottable_t *table, size_t *slot) {
+	if (table->num_free == 0) {
+		return false;
+	}
+
+	*slot = table->free[table->free_head];
+	table->free_head = (table->free_head + 1) % table->capacity;
+	table->num_free--;
+	return true;
+}
+
+void slottable_free(slottable_t *table, size_t slot) {
+	table->generations[slot]++;
+	table->free[(table->free_head + table->num_free) % table->capacity] = slot;
+	table->num_free++;
+}
@@ -0,0 +1,42 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Hands out the indices 0 to capacity - 1. Freed ones queue up behind the others, so an index isn't
+// reused sooner than it has to be, and a slot's generation changes every time it's freed, so whoever
+// remembers an index can tell it now belongs to someone else.
+typedef struct slottable_s {
+	size_t capacity;
+	size_t *free; // ring buffer, oldest first
+	size_t free_head;
+	size_t num_free;
+	uint32_t *generations;
+} slottable_t;
+
+slottable_t *slottable_create(size_t capacity);
+void slottable_destroy(slottable_t *table);
+
+bool slottable_alloc(slottable_t *table, size_t *slot);
+void slottable_free(slottable_t *table, size_t slot);
+
+static inline size_t slottable_used(const slottable_t *table) {
+	return table->capacity - table->num_free;
+}
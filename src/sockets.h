@@ -24,6 +24,7 @@
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include "buffer.h" // struct iovec
 
 #define SOCKET_EWOULDBLOCK WSAEWOULDBLOCK
 #define SOCKET_ECONNABORTED WSAECONNABORTED
@@ -33,9 +34,24 @@ typedef SOCKET socket_t;
 
 static inline int socket_error(void) { return WSAGetLastError(); }
 
+// Sends several pieces in one call, returns the number of bytes sent or SOCKET_ERROR.
+static inline int socket_sendv(socket_t socket, const struct iovec *iov, size_t count) {
+	WSABUF bufs[16];
+	count = count < 16 ? count : 16;
+	for (size_t i = 0; i < count; i++) {
+		bufs[i].buf = (CHAR *)iov[i].iov_base;
+		bufs[i].len = (ULONG)iov[i].iov_len;
+	}
+
+	DWORD sent;
+	return WSASend(socket, bufs, (DWORD)count, &sent, 0, NULL, NULL) == 0 ? (int)sent : SOCKET_ERROR;
+}
+
 #else
 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
 #include <netinet/in.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -55,4 +71,13 @@ typedef int socket_t;
 
 static inline int socket_error(void) { return errno; }
 
+// Sends several pieces in one call, returns the number of bytes sent or SOCKET_ERROR.
+static inline int socket_sendv(socket_t socket, const struct iovec *iov, size_t count) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = count;
+	return (int)sendmsg(socket, &msg, MSG_NOSIGNAL);
+}
+
 #endif
@@ -0,0 +1,546 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "voxdeflate.h"
+#include "endian.h"
+#include "util.h"
+
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define MAX_DIST 32768
+
+// Tokens gathered before a block is written out with its own Huffman tables.
+#define BLOCK_TOKENS 65536
+
+#define NUM_LITLEN 286
+#define NUM_DIST 30
+#define NUM_CODELEN 19
+
+static const uint8_t codelen_order[NUM_CODELEN] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+typedef struct {
+	uint32_t freq;
+	uint16_t symbol;
+} symfreq_t;
+
+voxdeflate_t *voxdeflate_create(size_t row_stride, size_t plane_stride, bool gzip) {
+	voxdeflate_t *vd = malloc(sizeof(*vd));
+	memset(vd, 0, sizeof(*vd));
+
+	vd->strides[vd->num_strides++] = 1;
+	if (row_stride > 1 && row_stride <= MAX_DIST) {
+		vd->strides[vd->num_strides++] = row_stride;
+	}
+	if (plane_stride > row_stride && plane_stride <= MAX_DIST) {
+		vd->strides[vd->num_strides++] = plane_stride;
+	}
+
+	vd->gzip = gzip;
+	vd->crc = crc32(0L, Z_NULL, 0);
+	vd->tokens = malloc(sizeof(*vd->tokens) * BLOCK_TOKENS);
+
+	return vd;
+}
+
+void voxdeflate_destroy(voxdeflate_t *vd) {
+	if (vd == NULL) {
+		return;
+	}
+
+	free(vd->window);
+	free(vd->tokens);
+	free(vd->out);
+	free(vd);
+}
+
+static void reserve_output(voxdeflate_t *vd, size_t len) {
+	if (vd->out_len + len > vd->out_size) {
+		vd->out_size = util_max(vd->out_size * 2, vd->out_len + len);
+		vd->out = realloc(vd->out, vd->out_size);
+	}
+}
+
+static void put_bits(voxdeflate_t *vd, uint32_t value, unsigned num_bits) {
+	vd->bits |= (uint64_t)value << vd->num_bits;
+	vd->num_bits += num_bits;
+
+	if (vd->num_bits >= 32) {
+		for (int i = 0; i < 4; i++) {
+			vd->out[vd->out_len++] = (uint8_t)vd->bits;
+			vd->bits >>= 8;
+		}
+
+		vd->num_bits -= 32;
+	}
+}
+
+// Writes out every whole byte, and the partial one too if pad is set.
+static void flush_bits(voxdeflate_t *vd, bool pad) {
+	reserve_output(vd, 8);
+
+	while (vd->num_bits >= 8 || (pad && vd->num_bits > 0)) {
+		vd->out[vd->out_len++] = (uint8_t)vd->bits;
+		vd->bits >>= 8;
+		vd->num_bits = vd->num_bits >= 8 ? vd->num_bits - 8 : 0;
+	}
+}
+
+static size_t match_length(const uint8_t *a, const uint8_t *b, size_t max) {
+	size_t len = 0;
+
+#ifdef ENDIAN_LITTLE
+	while (len + sizeof(uint64_t) <= max) {
+		uint64_t x, y;
+		memcpy(&x, a + len, sizeof(x));
+		memcpy(&y, b + len, sizeof(y));
+
+		if (x != y) {
+			return len + (__builtin_ctzll(x ^ y) >> 3);
+		}
+
+		len += sizeof(uint64_t);
+	}
+#endif
+
+	while (len < max && a[len] == b[len]) {
+		len++;
+	}
+
+	return len;
+}
+
+static unsigned length_code(unsigned len, unsigned *extra_bits, unsigned *extra) {
+	if (len == MAX_MATCH) {
+		*extra_bits = 0;
+		*extra = 0;
+		return 285;
+	}
+
+	const unsigned v = len - MIN_MATCH;
+	if (v < 8) {
+		*extra_bits = 0;
+		*extra = 0;
+		return 257 + v;
+	}
+
+	const unsigned nb = 31 - __builtin_clz(v);
+	*extra_bits = nb - 2;
+	*extra = v & ((1U << (nb - 2)) - 1);
+	return 257 + 4 * (nb - 1) + ((v >> (nb - 2)) & 3);
+}
+
+static unsigned dist_code(unsigned dist, unsigned *extra_bits, unsigned *extra) {
+	const unsigned v = dist - 1;
+	if (v < 4) {
+		*extra_bits = 0;
+		*extra = 0;
+		return v;
+	}
+
+	const unsigned nb = 31 - __builtin_clz(v);
+	*extra_bits = nb - 1;
+	*extra = v & ((1U << (nb - 1)) - 1);
+	return 2 * nb + ((v >> (nb - 1)) & 1);
+}
+
+static int compare_symfreq(const void *a, const void *b) {
+	const symfreq_t *x = a;
+	const symfreq_t *y = b;
+
+	if (x->freq != y->freq) {
+		return x->freq < y->freq ? -1 : 1;
+	}
+
+	return (int)x->symbol - (int)y->symbol;
+}
+
+// In-place minimum redundancy code lengths (Moffat & Katajainen). a holds the weights in ascending
+// order and is overwritten with the code lengths, longest first.
+static void minimum_redundancy(uint32_t *a, int n) {
+	int root, leaf, next, avail, used, depth;
+
+	a[0] += a[1];
+	root = 0;
+	leaf = 2;
+
+	for (next = 1; next < n - 1; next++) {
+		if (leaf >= n || a[root] < a[leaf]) {
+			a[next] = a[root];
+			a[root++] = next;
+		}
+		else {
+			a[next] = a[leaf++];
+		}
+
+		if (leaf >= n || (root < next && a[root] < a[leaf])) {
+			a[next] += a[root];
+			a[root++] = next;
+		}
+		else {
+			a[next] += a[leaf++];
+		}
+	}
+
+	a[n - 2] = 0;
+	for (next = n - 3; next >= 0; next--) {
+		a[next] = a[a[next]] + 1;
+	}
+
+	avail = 1;
+	used = depth = 0;
+	root = n - 2;
+	next = n - 1;
+
+	while (avail > 0) {
+		while (root >= 0 && (int)a[root] == depth) {
+			used++;
+			root--;
+		}
+
+		while (avail > used) {
+			a[next--] = depth;
+			avail--;
+		}
+
+		avail = 2 * used;
+		depth++;
+		used = 0;
+	}
+}
+
+static void build_lengths(const uint32_t *freqs, int num_symbols, unsigned limit, uint8_t *lengths) {
+	symfreq_t sorted[NUM_LITLEN];
+	uint32_t a[NUM_LITLEN];
+	int n = 0;
+
+	memset(lengths, 0, num_symbols);
+
+	for (int i = 0; i < num_symbols; i++) {
+		if (freqs[i] > 0) {
+			sorted[n].freq = freqs[i];
+			sorted[n].symbol = (uint16_t)i;
+			n++;
+		}
+	}
+
+	if (n == 0) {
+		return;
+	}
+
+	if (n == 1) {
+		lengths[sorted[0].symbol] = 1;
+		return;
+	}
+
+	qsort(sorted, n, sizeof(*sorted), compare_symfreq);
+
+	while (true) {
+		for (int i = 0; i < n; i++) {
+			a[i] = sorted[i].freq;
+		}
+
+		minimum_redundancy(a, n);
+
+		if (a[0] <= limit) {
+			break;
+		}
+
+		// Flattening the weights keeps their order, so the table stays sorted.
+		for (int i = 0; i < n; i++) {
+			sorted[i].freq = (sorted[i].freq + 1) >> 1;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		lengths[sorted[i].symbol] = (uint8_t)a[i];
+	}
+}
+
+// Canonical codes, bit-reversed since deflate sends Huffman codes starting from the top bit.
+static void build_codes(const uint8_t *lengths, int num_symbols, uint16_t *codes) {
+	unsigned count[16] = { 0 };
+	unsigned next[16];
+
+	for (int i = 0; i < num_symbols; i++) {
+		count[lengths[i]]++;
+	}
+	count[0] = 0;
+
+	unsigned code = 0;
+	for (int bits = 1; bits < 16; bits++) {
+		code = (code + count[bits - 1]) << 1;
+		next[bits] = code;
+	}
+
+	for (int i = 0; i < num_symbols; i++) {
+		const unsigned len = lengths[i];
+		if (len == 0) {
+			continue;
+		}
+
+		unsigned c = next[len]++;
+		unsigned reversed = 0;
+		for (unsigned b = 0; b < len; b++) {
+			reversed = (reversed << 1) | (c & 1);
+			c >>= 1;
+		}
+
+		codes[i] = (uint16_t)reversed;
+	}
+}
+
+static void write_block(voxdeflate_t *vd, bool final) {
+	uint32_t litlen_freqs[NUM_LITLEN] = { 0 };
+	uint32_t dist_freqs[NUM_DIST] = { 0 };
+	unsigned extra_bits, extra;
+
+	for (size_t i = 0; i < vd->num_tokens; i++) {
+		const voxtoken_t *t = &vd->tokens[i];
+		if (t->dist == 0) {
+			litlen_freqs[t->value]++;
+		}
+		else {
+			litlen_freqs[length_code(t->value, &extra_bits, &extra)]++;
+			dist_freqs[dist_code(t->dist, &extra_bits, &extra)]++;
+		}
+	}
+
+	litlen_freqs[256] = 1;
+
+	// A block without matches still needs one distance code.
+	bool has_dist = false;
+	for (int i = 0; i < NUM_DIST; i++) {
+		has_dist |= dist_freqs[i] > 0;
+	}
+	if (!has_dist) {
+		dist_freqs[0] = 1;
+	}
+
+	uint8_t lengths[NUM_LITLEN + NUM_DIST];
+	uint8_t *litlen_lengths = lengths;
+	uint8_t dist_lengths[NUM_DIST];
+	uint16_t litlen_codes[NUM_LITLEN], dist_codes[NUM_DIST];
+
+	build_lengths(litlen_freqs, NUM_LITLEN, 15, litlen_lengths);
+	build_lengths(dist_freqs, NUM_DIST, 15, dist_lengths);
+	build_codes(litlen_lengths, NUM_LITLEN, litlen_codes);
+	build_codes(dist_lengths, NUM_DIST, dist_codes);
+
+	int hlit = NUM_LITLEN;
+	while (hlit > 257 && litlen_lengths[hlit - 1] == 0) {
+		hlit--;
+	}
+
+	int hdist = NUM_DIST;
+	while (hdist > 1 && dist_lengths[hdist - 1] == 0) {
+		hdist--;
+	}
+
+	// Both length tables are sent as one sequence, run-length coded with symbols 16 to 18.
+	memmove(lengths + hlit, dist_lengths, hdist);
+	const int num_lengths = hlit + hdist;
+
+	uint8_t cl_symbols[NUM_LITLEN + NUM_DIST];
+	uint8_t cl_extra[NUM_LITLEN + NUM_DIST];
+	uint32_t cl_freqs[NUM_CODELEN] = { 0 };
+	int num_cl = 0;
+
+	for (int i = 0; i < num_lengths;) {
+		const uint8_t len = lengths[i];
+		int run = 1;
+		while (i + run < num_lengths && lengths[i + run] == len) {
+			run++;
+		}
+
+		if (len == 0 && run >= 3) {
+			run = util_min(run, 138);
+			cl_symbols[num_cl] = run >= 11 ? 18 : 17;
+			cl_extra[num_cl] = (uint8_t)(run >= 11 ? run - 11 : run - 3);
+			i += run;
+		}
+		else if (len != 0 && run >= 4) {
+			cl_symbols[num_cl] = len;
+			cl_extra[num_cl] = 0;
+			cl_freqs[len]++;
+			num_cl++;
+
+			run = util_min(run - 1, 6);
+			cl_symbols[num_cl] = 16;
+			cl_extra[num_cl] = (uint8_t)(run - 3);
+			i += 1 + run;
+		}
+		else {
+			cl_symbols[num_cl] = len;
+			cl_extra[num_cl] = 0;
+			i++;
+		}
+
+		cl_freqs[cl_symbols[num_cl]]++;
+		num_cl++;
+	}
+
+	uint8_t cl_lengths[NUM_CODELEN];
+	uint16_t cl_codes[NUM_CODELEN];
+	build_lengths(cl_freqs, NUM_CODELEN, 7, cl_lengths);
+	build_codes(cl_lengths, NUM_CODELEN, cl_codes);
+
+	int hclen = NUM_CODELEN;
+	while (hclen > 4 && cl_lengths[codelen_order[hclen - 1]] == 0) {
+		hclen--;
+	}
+
+	// Worst case is 15 + 5 + 15 + 13 bits per token, plus the tables.
+	reserve_output(vd, vd->num_tokens * 6 + 1024);
+
+	put_bits(vd, final ? 1 : 0, 1);
+	put_bits(vd, 2, 2);
+	put_bits(vd, hlit - 257, 5);
+	put_bits(vd, hdist - 1, 5);
+	put_bits(vd, hclen - 4, 4);
+
+	for (int i = 0; i < hclen; i++) {
+		put_bits(vd, cl_lengths[codelen_order[i]], 3);
+	}
+
+	static const uint8_t cl_extra_bits[3] = { 2, 3, 7 };
+	for (int i = 0; i < num_cl; i++) {
+		const uint8_t sym = cl_symbols[i];
+		put_bits(vd, cl_codes[sym], cl_lengths[sym]);
+		if (sym >= 16) {
+			put_bits(vd, cl_extra[i], cl_extra_bits[sym - 16]);
+		}
+	}
+
+	for (size_t i = 0; i < vd->num_tokens; i++) {
+		const voxtoken_t *t = &vd->tokens[i];
+		if (t->dist == 0) {
+			put_bits(vd, litlen_codes[t->value], litlen_lengths[t->value]);
+			continue;
+		}
+
+		const unsigned lc = length_code(t->value, &extra_bits, &extra);
+		put_bits(vd, litlen_codes[lc], litlen_lengths[lc]);
+		put_bits(vd, extra, extra_bits);
+
+		const unsigned dc = dist_code(t->dist, &extra_bits, &extra);
+		put_bits(vd, dist_codes[dc], dist_lengths[dc]);
+		put_bits(vd, extra, extra_bits);
+	}
+
+	put_bits(vd, litlen_codes[256], litlen_lengths[256]);
+
+	vd->num_tokens = 0;
+}
+
+static void put_le32(voxdeflate_t *vd, uint32_t value) {
+	reserve_output(vd, 4);
+	for (int i = 0; i < 4; i++) {
+		vd->out[vd->out_len++] = (uint8_t)(value >> (i * 8));
+	}
+}
+
+size_t voxdeflate_compress(voxdeflate_t *vd, const uint8_t *data, size_t len, bool last, const uint8_t **out) {
+	vd->out_len = 0;
+
+	if (!vd->started && vd->gzip) {
+		static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+		reserve_output(vd, sizeof(header));
+		memcpy(vd->out, header, sizeof(header));
+		vd->out_len = sizeof(header);
+	}
+	vd->started = true;
+
+	if (vd->gzip) {
+		vd->crc = crc32(vd->crc, data, len);
+		vd->total_in += len;
+	}
+
+	if (vd->history + len > vd->window_size) {
+		vd->window_size = vd->history + len;
+		vd->window = realloc(vd->window, vd->window_size);
+	}
+
+	memcpy(vd->window + vd->history, data, len);
+
+	const uint8_t *window = vd->window;
+	const size_t end = vd->history + len;
+	size_t pos = vd->history;
+	size_t last_dist = 1;
+
+	while (pos < end) {
+		const size_t max = util_min(MAX_MATCH, end - pos);
+		size_t best_len = 0, best_dist = 0;
+
+		if (max >= MIN_MATCH) {
+			if (last_dist <= pos) {
+				best_len = match_length(window + pos, window + pos - last_dist, max);
+				best_dist = last_dist;
+			}
+
+			for (size_t i = 0; i < vd->num_strides && best_len < max; i++) {
+				const size_t dist = vd->strides[i];
+				if (dist > pos || dist == last_dist) {
+					continue;
+				}
+
+				const size_t l = match_length(window + pos, window + pos - dist, max);
+				if (l > best_len) {
+					best_len = l;
+					best_dist = dist;
+				}
+			}
+		}
+
+		voxtoken_t *t = &vd->tokens[vd->num_tokens++];
+		if (best_len >= MIN_MATCH) {
+			t->value = (uint16_t)best_len;
+			t->dist = (uint16_t)best_dist;
+			last_dist = best_dist;
+			pos += best_len;
+		}
+		else {
+			t->value = window[pos];
+			t->dist = 0;
+			pos++;
+		}
+
+		if (vd->num_tokens == BLOCK_TOKENS) {
+			write_block(vd, false);
+		}
+	}
+
+	if (vd->num_tokens > 0 || last) {
+		write_block(vd, last);
+	}
+
+	flush_bits(vd, last);
+
+	if (last && vd->gzip) {
+		put_le32(vd, vd->crc);
+		put_le32(vd, vd->total_in);
+	}
+
+	// Keep the last 32KB around for the next call to match against.
+	const size_t keep = util_min(end, MAX_DIST);
+	memmove(vd->window, vd->window + end - keep, keep);
+	vd->history = keep;
+
+	*out = vd->out;
+	return vd->out_len;
+}
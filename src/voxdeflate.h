@@ -0,0 +1,58 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A deflate encoder for level data. Instead of hashing it only looks for matches at the distances that
+// repeat in a level: the previous block, the previous row and the previous plane, plus whatever distance
+// matched last. The output is a standard deflate (or gzip) stream.
+
+typedef struct voxtoken_s {
+	uint16_t value; // literal byte, or match length
+	uint16_t dist;  // 0 for literals
+} voxtoken_t;
+
+typedef struct voxdeflate_s {
+	size_t strides[3];
+	size_t num_strides;
+	bool gzip;
+
+	uint8_t *window; // up to 32KB of history followed by the data being compressed
+	size_t window_size;
+	size_t history;
+
+	voxtoken_t *tokens;
+	size_t num_tokens;
+
+	uint8_t *out;
+	size_t out_len, out_size;
+	uint64_t bits;
+	unsigned num_bits;
+
+	bool started;
+	uint32_t crc;
+	uint32_t total_in;
+} voxdeflate_t;
+
+voxdeflate_t *voxdeflate_create(size_t row_stride, size_t plane_stride, bool gzip);
+void voxdeflate_destroy(voxdeflate_t *vd);
+
+// Compresses the next len bytes of the stream. Everything up to the last whole byte is returned in *out
+// and stays valid until the next call. The stream is finished when last is set.
+size_t voxdeflate_compress(voxdeflate_t *vd, const uint8_t *data, size_t len, bool last, const uint8_t **out);
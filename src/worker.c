@@ -0,0 +1,165 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "worker.h"
+#include "log.h"
+
+typedef struct job_s {
+	jobfunc_t func;
+	jobfunc_t done;
+	void *data;
+	struct job_s *next;
+} job_t;
+
+typedef struct {
+	job_t *head, *tail;
+} jobqueue_t;
+
+static pthread_t *threads = NULL;
+static unsigned num_threads = 0;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static jobqueue_t queues[jobpriority_count];
+static bool stopping = false;
+
+static pthread_mutex_t completed_mutex = PTHREAD_MUTEX_INITIALIZER;
+static jobqueue_t completed;
+
+static void jobqueue_push(jobqueue_t *queue, job_t *job) {
+	job->next = NULL;
+
+	if (queue->tail != NULL) {
+		queue->tail->next = job;
+	}
+	else {
+		queue->head = job;
+	}
+
+	queue->tail = job;
+}
+
+static job_t *jobqueue_pop(jobqueue_t *queue) {
+	job_t *job = queue->head;
+	if (job != NULL) {
+		queue->head = job->next;
+		if (queue->head == NULL) {
+			queue->tail = NULL;
+		}
+	}
+
+	return job;
+}
+
+static void *worker_main(void *data) {
+	(void)data;
+
+	pthread_mutex_lock(&queue_mutex);
+
+	while (true) {
+		job_t *job = NULL;
+		for (int i = 0; i < jobpriority_count && job == NULL; i++) {
+			job = jobqueue_pop(&queues[i]);
+		}
+
+		if (job == NULL) {
+			// Only stop once the queues are empty, so nothing submitted before shutdown is lost.
+			if (stopping) {
+				break;
+			}
+
+			pthread_cond_wait(&queue_cond, &queue_mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&queue_mutex);
+
+		job->func(job->data);
+
+		if (job->done != NULL) {
+			pthread_mutex_lock(&completed_mutex);
+			jobqueue_push(&completed, job);
+			pthread_mutex_unlock(&completed_mutex);
+		}
+		else {
+			free(job);
+		}
+
+		pthread_mutex_lock(&queue_mutex);
+	}
+
+	pthread_mutex_unlock(&queue_mutex);
+	return NULL;
+}
+
+void worker_init(unsigned count) {
+	stopping = false;
+	threads = malloc(sizeof(*threads) * count);
+
+	for (num_threads = 0; num_threads < count; num_threads++) {
+		if (pthread_create(&threads[num_threads], NULL, worker_main, NULL) != 0) {
+			log_printf(log_error, "Failed to start worker thread %u", num_threads);
+			break;
+		}
+	}
+
+	log_printf(log_info, "Started %u worker threads", num_threads);
+}
+
+void worker_shutdown(void) {
+	pthread_mutex_lock(&queue_mutex);
+	stopping = true;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	for (unsigned i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	threads = NULL;
+	num_threads = 0;
+
+	worker_poll();
+}
+
+void worker_submit(jobpriority_t priority, jobfunc_t func, jobfunc_t done, void *data) {
+	job_t *job = malloc(sizeof(*job));
+	job->func = func;
+	job->done = done;
+	job->data = data;
+
+	pthread_mutex_lock(&queue_mutex);
+	jobqueue_push(&queues[priority], job);
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void worker_poll(void) {
+	pthread_mutex_lock(&completed_mutex);
+	job_t *job = completed.head;
+	completed.head = completed.tail = NULL;
+	pthread_mutex_unlock(&completed_mutex);
+
+	while (job != NULL) {
+		job_t *next = job->next;
+		job->done(job->data);
+		free(job);
+		job = next;
+	}
+}
@@ -0,0 +1,35 @@
+// Thirty, a ClassiCube (Minecraft Classic) server
+// Copyright (C) 2024 Sean Baggaley
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+#include <stdbool.h>
+
+typedef enum {
+	jobpriority_high,
+	jobpriority_normal,
+	jobpriority_low,
+	jobpriority_count
+} jobpriority_t;
+
+typedef void (*jobfunc_t)(void *data);
+
+void worker_init(unsigned num_threads);
+void worker_shutdown(void);
+
+// Queues func to run on a worker thread. If done isn't NULL it's called with the same data on the main
+// thread, from worker_poll(), once func has returned.
+void worker_submit(jobpriority_t priority, jobfunc_t func, jobfunc_t done, void *data);
+void worker_poll(void);